@@ -0,0 +1,281 @@
+/*
+    charset.c : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <errno.h>
+#include <iconv.h>
+
+#include "charset.h"
+
+
+/* iconv name of Shift-JIS. CP932 is a superset used by most Japanese tools. */
+#define SJIS_ICONV_NAME "CP932"
+
+
+static unsigned char upper_table[256];	/* ASCII only toupper() */
+static unsigned char lower_table[256];	/* ASCII only tolower() */
+static int tables_ready = 0;
+
+static iconv_t sjis_to_utf8 = (iconv_t)-1;
+static iconv_t utf8_to_sjis = (iconv_t)-1;
+
+
+/* Return non null if the first length bytes of text are ASCII.
+   Test 8 bytes at a time, the compiler can vectorize this loop. */
+static int is_ascii( const char *text, size_t length )
+{
+	uint64_t bits = 0;
+	size_t i;
+
+	for( i=0; i+8<=length; i+=8 ) {
+		uint64_t word;
+
+		memcpy( &word, text + i, 8 );
+		bits |= word;
+	}
+	for( ; i<length; i++ )
+		bits |= (unsigned char)text[i];
+
+	return( ( bits & 0x8080808080808080ULL ) == 0 );
+}
+
+static int is_utf8( const unsigned char *text )
+{
+	while( *text ) {
+		int count;
+
+		if( *text < 0x80 )
+			count = 0;
+		else if( *text >= 0xC2 && *text <= 0xDF )
+			count = 1;
+		else if( *text >= 0xE0 && *text <= 0xEF )
+			count = 2;
+		else if( *text >= 0xF0 && *text <= 0xF4 )
+			count = 3;
+		else
+			return 0;
+
+		text++;
+		while( count-- > 0 ) {
+			if( ( *text & 0xC0 ) != 0x80 )
+				return 0;
+			text++;
+		}
+	}
+
+	return 1;
+}
+
+/* Return non null if text is valid Shift-JIS holding at least one Japanese character.
+   Latin-1 letters are also valid half-width katakana or lead bytes, so only a
+   double-byte character starting with 0x81-0x9F counts: these bytes are control
+   characters in Latin-1. Kana, symbols and level 1 kanji all start there. */
+static int is_sjis( const unsigned char *text )
+{
+	int japanese = 0;
+
+	while( *text ) {
+		if( *text < 0x80 || ( *text >= 0xA1 && *text <= 0xDF ) ) {
+			/* ASCII or half-width katakana */
+			text++;
+		} else if( ( *text >= 0x81 && *text <= 0x9F ) || ( *text >= 0xE0 && *text <= 0xFC ) ) {
+			/* Double-byte character */
+			if( !( ( text[1] >= 0x40 && text[1] <= 0x7E ) || ( text[1] >= 0x80 && text[1] <= 0xFC ) ) )
+				return 0;
+			if( *text <= 0x9F )
+				japanese = 1;
+			text += 2;
+		} else {
+			return 0;
+		}
+	}
+
+	return japanese;
+}
+
+/* Convert text with iconv. Characters which can not be converted are replaced with '?'. */
+static char *convert( iconv_t cd, const char *text, char *buffer, int from_utf8 )
+{
+	char *in = (char *)text;
+	size_t in_left = strlen( text );
+	char *out = buffer;
+	size_t out_left = CHARSET_BUFFER_SIZE - 1;
+
+	iconv( cd, NULL, NULL, NULL, NULL );
+	while( in_left > 0 && iconv( cd, &in, &in_left, &out, &out_left ) == (size_t)-1 ) {
+		if( errno != EILSEQ || out_left == 0 )
+			break;
+		*out++ = '?';
+		out_left--;
+		/* Skip the whole invalid character */
+		do {
+			in++;
+			in_left--;
+		} while( from_utf8 && in_left > 0 && ( *in & 0xC0 ) == 0x80 );
+	}
+	*out = '\0';
+
+	return buffer;
+}
+
+static void copy( const char *text, char *buffer )
+{
+	strncpy( buffer, text, CHARSET_BUFFER_SIZE - 1 );
+	buffer[CHARSET_BUFFER_SIZE - 1] = '\0';
+}
+
+int charset_from_name( const char *name )
+{
+	if( strcasecmp( name, "auto" ) == 0 )
+		return CHARSET_AUTO;
+	if( strcasecmp( name, "utf-8" ) == 0 || strcasecmp( name, "utf8" ) == 0 )
+		return CHARSET_UTF8;
+	if( strcasecmp( name, "latin1" ) == 0 || strcasecmp( name, "iso-8859-1" ) == 0 )
+		return CHARSET_LATIN1;
+	if( strcasecmp( name, "sjis" ) == 0 || strcasecmp( name, "shift-jis" ) == 0 )
+		return CHARSET_SJIS;
+
+	return -1;
+}
+
+int charset_detect( const char *text )
+{
+	if( is_ascii( text, strlen( text ) ) || is_utf8( (const unsigned char *)text ) )
+		return CHARSET_UTF8;
+	if( is_sjis( (const unsigned char *)text ) )
+		return CHARSET_SJIS;
+
+	return CHARSET_LATIN1;
+}
+
+char *charset_to_utf8( const char *text, int charset, char *buffer )
+{
+	size_t length = strlen( text );
+
+	/* Most tags are ASCII, nothing to do */
+	if( is_ascii( text, length ) ) {
+		copy( text, buffer );
+		return buffer;
+	}
+
+	if( charset == CHARSET_AUTO )
+		charset = charset_detect( text );
+
+	switch( charset ) {
+		case CHARSET_LATIN1: {
+			const unsigned char *in = (const unsigned char *)text;
+			char *out = buffer;
+
+			/* Every Latin-1 character is 1 or 2 bytes long in UTF-8 */
+			for( ; *in && out - buffer < CHARSET_BUFFER_SIZE - 2; in++ ) {
+				if( *in < 0x80 ) {
+					*out++ = *in;
+				} else {
+					*out++ = 0xC0 | ( *in >> 6 );
+					*out++ = 0x80 | ( *in & 0x3F );
+				}
+			}
+			*out = '\0';
+			return buffer;
+		}
+		case CHARSET_SJIS:
+			if( sjis_to_utf8 == (iconv_t)-1 )
+				sjis_to_utf8 = iconv_open( "UTF-8", SJIS_ICONV_NAME );
+			if( sjis_to_utf8 != (iconv_t)-1 )
+				return convert( sjis_to_utf8, text, buffer, 0 );
+			break;
+	}
+
+	copy( text, buffer );
+	return buffer;
+}
+
+char *charset_from_utf8( const char *text, int charset, char *buffer )
+{
+	if( is_ascii( text, strlen( text ) ) ) {
+		copy( text, buffer );
+		return buffer;
+	}
+
+	switch( charset ) {
+		case CHARSET_LATIN1: {
+			const unsigned char *in = (const unsigned char *)text;
+			char *out = buffer;
+
+			for( ; *in && out - buffer < CHARSET_BUFFER_SIZE - 1; in++ ) {
+				if( *in < 0x80 ) {
+					*out++ = *in;
+				} else if( ( *in == 0xC2 || *in == 0xC3 ) && ( in[1] & 0xC0 ) == 0x80 ) {
+					*out++ = ( ( *in & 0x03 ) << 6 ) | ( in[1] & 0x3F );
+					in++;
+				} else {
+					/* Not a Latin-1 character, skip continuation bytes */
+					*out++ = '?';
+					while( ( in[1] & 0xC0 ) == 0x80 )
+						in++;
+				}
+			}
+			*out = '\0';
+			return buffer;
+		}
+		case CHARSET_SJIS:
+			if( utf8_to_sjis == (iconv_t)-1 )
+				utf8_to_sjis = iconv_open( SJIS_ICONV_NAME, "UTF-8" );
+			if( utf8_to_sjis != (iconv_t)-1 )
+				return convert( utf8_to_sjis, text, buffer, 1 );
+			break;
+	}
+
+	copy( text, buffer );
+	return buffer;
+}
+
+static void init_tables()
+{
+	int c;
+
+	for( c=0; c<256; c++ ) {
+		upper_table[c] = ( c >= 'a' && c <= 'z' ) ? c - 'a' + 'A' : c;
+		lower_table[c] = ( c >= 'A' && c <= 'Z' ) ? c - 'A' + 'a' : c;
+	}
+	tables_ready = 1;
+}
+
+/* Change case of ASCII letters only, so UTF-8 sequences are kept intact */
+void charset_toupper( char *text )
+{
+	if( ! tables_ready )
+		init_tables();
+	for( ; *text; text++ )
+		*text = upper_table[(unsigned char)*text];
+}
+
+void charset_tolower( char *text )
+{
+	if( ! tables_ready )
+		init_tables();
+	for( ; *text; text++ )
+		*text = lower_table[(unsigned char)*text];
+}
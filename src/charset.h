@@ -0,0 +1,37 @@
+/*
+    charset.h : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+
+/* Size of buffers given to conversion functions */
+#define CHARSET_BUFFER_SIZE 1024
+
+/* Charsets of tags */
+#define CHARSET_AUTO   0
+#define CHARSET_UTF8   1
+#define CHARSET_LATIN1 2
+#define CHARSET_SJIS   3
+
+int charset_from_name( const char *name );
+int charset_detect( const char *text );
+char *charset_to_utf8( const char *text, int charset, char *buffer );
+char *charset_from_utf8( const char *text, int charset, char *buffer );
+void charset_toupper( char *text );
+void charset_tolower( char *text );
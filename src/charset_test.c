@@ -0,0 +1,68 @@
+/*
+    charset_test.c : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "charset.h"
+
+
+typedef struct
+{
+	const char *text;	/* Tag as stored in the file    */
+	int charset;		/* Expected detected charset    */
+	const char *utf8;	/* Expected text once converted */
+} charset_case;
+
+static const charset_case cases[] = {
+	{ "Super Mario World",                CHARSET_UTF8,   "Super Mario World"   },
+	{ "Gro\xDF",                          CHARSET_LATIN1, "Gro\xC3\x9F"         },
+	{ "\xC4rger",                         CHARSET_LATIN1, "\xC3\x84rger"        },
+	{ "Pok\xE9mon",                       CHARSET_LATIN1, "Pok\xC3\xA9mon"      },
+	{ "cr\xE9\xE9",                       CHARSET_LATIN1, "cr\xC3\xA9\xC3\xA9"  },
+	{ "\xB1\xB2\xB3",                     CHARSET_LATIN1, "\xC2\xB1\xC2\xB2\xC2\xB3" },
+	{ "Pok\xC3\xA9mon",                   CHARSET_UTF8,   "Pok\xC3\xA9mon"      },
+	{ "\x83\x5A\x83\x8A\x83\x74",         CHARSET_SJIS,   "\xE3\x82\xBB\xE3\x83\xAA\xE3\x83\x95" },
+	{ "FF \x83\x5A\x83\x8A\x83\x74 \xB1", CHARSET_SJIS,   "FF \xE3\x82\xBB\xE3\x83\xAA\xE3\x83\x95 \xEF\xBD\xB1" },
+	{ "\x83",                             CHARSET_LATIN1, "\xC2\x83"            },
+	{ "\x83\x20",                         CHARSET_LATIN1, "\xC2\x83 "           },
+};
+
+
+int main()
+{
+	char buffer[CHARSET_BUFFER_SIZE];
+	int failures = 0;
+	size_t i;
+
+	for( i=0; i<sizeof( cases )/sizeof( charset_case ); i++ ) {
+		int charset = charset_detect( cases[i].text );
+
+		charset_to_utf8( cases[i].text, CHARSET_AUTO, buffer );
+		if( charset != cases[i].charset || strcmp( buffer, cases[i].utf8 ) != 0 ) {
+			fprintf( stderr, "Case %zu: charset %d instead of %d, \"%s\" instead of \"%s\"\n",
+				i, charset, cases[i].charset, buffer, cases[i].utf8 );
+			failures++;
+		}
+	}
+
+	return( failures ? 1 : 0 );
+}
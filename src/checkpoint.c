@@ -0,0 +1,211 @@
+/*
+    checkpoint.c : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+    A checkpoint file holds one line per processed input :
+      done	FILE
+      failed	ERROR	FILE
+    where ERROR is a return code from constants.h. When an input appears
+    several times, the last line is the right one.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "checkpoint.h"
+#include "util.h"
+
+
+/* Number of lines written between two syncs */
+#define CHECKPOINT_BATCH 256
+
+
+typedef struct
+{
+	char *input;
+	int status;
+} checkpoint_entry;
+
+
+static FILE *checkpoint = NULL;		/* The opened checkpoint file    */
+static int pending = 0;			/* Lines written since last sync */
+static char *current_input = NULL;	/* Input being processed         */
+static int current_failed = 0;		/* Non null if it failed         */
+static checkpoint_entry *entries = NULL;	/* Hash table of previous statuses */
+static size_t entry_count = 0;
+static size_t slot_count = 0;
+
+
+static checkpoint_entry *find_entry( const char *input )
+{
+	uint64_t hash = fnv1a( FNV1A_INIT, input, strlen( input ) );
+	size_t i;
+
+	for( i=hash & ( slot_count - 1 ); entries[i].input; i=( i + 1 ) & ( slot_count - 1 ) ) {
+		if( strcmp( entries[i].input, input ) == 0 )
+			break;
+	}
+
+	return &entries[i];
+}
+
+static void set_status( const char *input, int status )
+{
+	checkpoint_entry *entry;
+
+	if( ( entry_count + 1 ) * 2 > slot_count ) {
+		checkpoint_entry *old_entries = entries;
+		size_t old_count = slot_count;
+		size_t i;
+
+		slot_count = slot_count ? slot_count * 2 : 1024;
+		entries = calloc( slot_count, sizeof( checkpoint_entry ) );
+		for( i=0; i<old_count; i++ ) {
+			if( old_entries[i].input )
+				*find_entry( old_entries[i].input ) = old_entries[i];
+		}
+		free( old_entries );
+	}
+
+	entry = find_entry( input );
+	if( entry->input == NULL ) {
+		entry->input = strdup( input );
+		entry_count++;
+	}
+	entry->status = status;
+}
+
+static int load( char *filename )
+{
+	FILE *file;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t length;
+
+	/* Nothing to resume */
+	if( ( file = fopen( filename, "r" ) ) == NULL )
+		return( 0 );
+
+	while( ( length = getline( &line, &size, file ) ) > 0 ) {
+		char *input;
+
+		if( line[length-1] != '\n' )
+			continue;
+		line[length-1] = '\0';
+
+		if( strncmp( line, "done\t", 5 ) == 0 ) {
+			set_status( line + 5, CHECKPOINT_DONE );
+		} else if( strncmp( line, "failed\t", 7 ) == 0 && ( input = strchr( line + 7, '\t' ) ) != NULL ) {
+			set_status( input + 1, CHECKPOINT_FAILED );
+		}
+	}
+
+	free( line );
+	fclose( file );
+
+	return( 0 );
+}
+
+static int add_line( const char *status, int error )
+{
+	int ret;
+
+	/* Such names can not be read back */
+	if( current_input == NULL || strchr( current_input, '\n' ) )
+		return( 0 );
+
+	if( error )
+		ret = fprintf( checkpoint, "%s\t%d\t%s\n", status, error, current_input );
+	else
+		ret = fprintf( checkpoint, "%s\t%s\n", status, current_input );
+	if( ret < 0 ) {
+		perror( "Can not write checkpoint!" );
+		return( E_CHECKPOINT );
+	}
+
+	/* Make a batch of lines durable */
+	if( ++pending >= CHECKPOINT_BATCH )
+		return checkpoint_commit();
+
+	return( 0 );
+}
+
+int checkpoint_open( char *filename, int resume )
+{
+	if( resume )
+		load( filename );
+
+	if( ( checkpoint = fopen( filename, resume ? "a" : "w" ) ) == NULL ) {
+		perror( "Unable to open checkpoint file!" );
+		return( E_CHECKPOINT );
+	}
+
+	return( 0 );
+}
+
+int checkpoint_status( char *input )
+{
+	if( slot_count == 0 )
+		return CHECKPOINT_NONE;
+
+	return find_entry( input )->status;
+}
+
+void checkpoint_start( char *input )
+{
+	current_input = input;
+	current_failed = 0;
+}
+
+void checkpoint_failed( int error )
+{
+	if( checkpoint == NULL || current_failed )
+		return;
+
+	current_failed = 1;
+	add_line( "failed", error );
+}
+
+void checkpoint_done()
+{
+	if( checkpoint == NULL || current_failed )
+		return;
+
+	add_line( "done", 0 );
+}
+
+int checkpoint_commit()
+{
+	if( checkpoint == NULL )
+		return( 0 );
+
+	pending = 0;
+	if( fflush( checkpoint ) != 0 || fsync( fileno( checkpoint ) ) != 0 ) {
+		perror( "Can not sync checkpoint!" );
+		return( E_CHECKPOINT );
+	}
+
+	return( 0 );
+}
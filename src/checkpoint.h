@@ -0,0 +1,31 @@
+/*
+    checkpoint.h : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Status of an input in a checkpoint file */
+#define CHECKPOINT_NONE   0
+#define CHECKPOINT_DONE   1
+#define CHECKPOINT_FAILED 2
+
+int checkpoint_open( char *filename, int resume );
+int checkpoint_status( char *input );
+void checkpoint_start( char *input );
+void checkpoint_failed( int error );
+void checkpoint_done();
+int checkpoint_commit();
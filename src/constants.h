@@ -44,6 +44,12 @@
 #define E_CH_DIR      -204
 #define E_DEL_DIR     -205
 #define E_DEL_FILE    -206
+#define E_COPY_FILE   -207
+#define E_LOCK_FILE   -208
 #define E_FORK        -300
 #define E_PACK_RSN    -400
 #define E_UNPACK_RSN  -401
+#define E_JOURNAL     -500
+#define E_INDEX       -600
+#define E_CHECKPOINT  -700
+#define E_SYNC        -800
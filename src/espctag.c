@@ -21,20 +21,34 @@
 */
 
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 #include <argp.h>
 #include <argz.h>
 #include <spctag.h>
 
 #include "constants.h"
+#include "journal.h"
+#include "charset.h"
+#include "index.h"
+#include "checkpoint.h"
+#include "sync.h"
+#include "util.h"
 
 
 #define exit_or_cont(ret) {              \
+		checkpoint_failed( ret );\
 		if( arguments.no_error ) \
 			continue;        \
 		else                     \
@@ -42,15 +56,35 @@
         }
 
 
-void process_spc_file( FILE *spc_file );
+int process_spc_file( FILE *spc_file, char *file, char *archive, char *journal_name, char *renamed );
+int journal_spc_file( FILE *spc_file, char *archive, char *old_name, char *new_name );
+void print_tags( int all );
+void set_tags( FILE *spc_file );
 void print_tag_type();
-int rename_spc_file( char *file );
+int rename_spc_file( char *file, char *new_filename );
 char *get_new_filename( char *new_filename, char* rename_format );
 int is_rsn_file( FILE *spc_file );
+int in_shard( const char *path );
+char *next_input( const char *prev );
+int lock_file( FILE **file, char *filename, short type );
 int backup_rsn_file( char *filename );
+int mirror_file( char *filename, char *mirror_filename );
+int clone_file( char *src, char *dest );
+int install_copy( int fd, char *tmp_filename, char *dest );
+int make_dirs( char *path );
 int unpack_rsn_file( char* filename, char *dest );
 int pack_rsn_file( char* filename, char *dest );
+int repack_rsn_file( char* filename, char *dest, int backup );
 int del_tmp_dir( char *dirname );
+int undo_journal( char *filename );
+void commit_journal();
+void index_spc_file( char *old_path, char *old_member, char *path, char *member );
+void save_index();
+void commit_checkpoint();
+int load_sync_source( char *dirname );
+int sync_tree( char *dirname );
+int sync_spc_file( char *filename, sync_entry *entry );
+char *get_tag( int index, char *buffer );
 
 
 /* This structure holds all that is necessary to print or set a tag */
@@ -87,6 +121,36 @@ static char doc[] = "espctag is an ID666 tags editor."
 /* Synopsis */
 static char args_doc[] = "FILE ...";
 
+/* Keys of options without a short name */
+#define OPT_OUTPUT_DIR 256
+#define OPT_JOURNAL    257
+#define OPT_UNDO       258
+#define OPT_CHARSET    259
+#define OPT_INDEX      260
+#define OPT_SEARCH     261
+#define OPT_FUZZY      262
+#define OPT_CHECKPOINT 263
+#define OPT_RESUME     264
+#define OPT_SYNC       265
+#define OPT_DELTA      266
+#define OPT_APPLY      267
+#define OPT_SHARD      268
+#define OPT_OP         269
+#define OPT_FILES_FROM 270
+#define OPT_COMPACT    271
+
+/* Operations done on each file */
+#define OP_GET    0
+#define OP_SET    1
+#define OP_RENAME 2
+#define OP_PRINT  3
+#define MAX_OPS   16
+
+/* Values of --resume */
+#define RESUME_NONE   0
+#define RESUME_ALL    1
+#define RESUME_FAILED 2
+
 /* This structure holds all "global" options */
 struct arguments
 {
@@ -101,6 +165,25 @@ struct arguments
 	int no_error;		/* Non null if no error mode is on                  */
 	int verbose;		/* Non null if verbose mode is on                   */
 	int all;		/* Non null if the user use the --all switch        */
+	char *output_dir;	/* Directory where modified copies are written      */
+	char *journal;		/* Journal where original headers are saved         */
+	char *undo;		/* Journal to replay in reverse                     */
+	int charset;		/* Charset of tags in files                         */
+	char *index;		/* Search index to update                           */
+	char *search;		/* Text to search in index                          */
+	int fuzzy;		/* Non null if search is fuzzy                      */
+	int compact;		/* Non null if index must be compacted              */
+	char *checkpoint;	/* File where processed inputs are saved            */
+	int resume;		/* Inputs to skip from checkpoint file              */
+	char *sync;		/* Reference directory to sync files with           */
+	char *delta;		/* File where sync changes are written              */
+	char *apply_delta;	/* Delta file to apply                              */
+	unsigned long shard;	/* Index of the shard to process                    */
+	unsigned long shards;	/* Number of shards, 0 if files are not sharded     */
+	int ops[MAX_OPS];	/* Operations to do on each file, in order          */
+	int op_count;		/* Number of operations                             */
+	char *files_from;	/* File holding more file names, "-" for stdin      */
+	int null;		/* Non null if file names end with '\0'             */
 	char *argz;		/* SPC file names                                   */
 	size_t argz_len;	/* Length of file names                             */
 };
@@ -110,6 +193,7 @@ static struct argp_option options[] = {
 	{ 0, 0, 0, 0, "Operations (mutually exclusive) :", 1 },
 	{ "set",  's', 0, 0, "Set tags"   },
 	{ "get",  'g', 0, 0, "Print tags" },
+	{ "op",   OPT_OP, "OP", 0, "Do OP (get, set, rename or print) on each file, can be repeated" },
 	{ 0, 0, 0, 0, "Global options :", 5 },
 	{ "file",       'f', 0,               0, "Print file names"        },
 	{ "field",      'n', 0,               0, "Don't print field names" },
@@ -118,6 +202,22 @@ static struct argp_option options[] = {
 	{ "backup-rsn", 'b', 0,               0, "Backup RSN files"        },
 	{ "no-error",   'e', 0,               0, "Don't stop on errors"    },
 	{ "verbose",    'v', 0,               0, "Verbose mode"            },
+	{ "files-from", OPT_FILES_FROM, "FILE", 0, "Read file names from FILE, - for stdin" },
+	{ "null",       '0', 0,               0, "File names read with --files-from end with NUL" },
+	{ "output-dir", OPT_OUTPUT_DIR, "DIR", 0, "Modify copies in DIR"   },
+	{ "journal",    OPT_JOURNAL, "JOURNAL", 0, "Save undo data in JOURNAL" },
+	{ "undo",       OPT_UNDO,    "JOURNAL", 0, "Undo changes saved in JOURNAL" },
+	{ "charset",    OPT_CHARSET, "CHARSET", 0, "Charset of tags (auto, utf-8, latin1, sjis)" },
+	{ "index",      OPT_INDEX,   "INDEX",   0, "Update search index INDEX" },
+	{ "search",     OPT_SEARCH,  "TEXT",    0, "Search TEXT in index"      },
+	{ "fuzzy",      OPT_FUZZY,   0,         0, "Approximate search"        },
+	{ "compact",    OPT_COMPACT, 0,         0, "Merge index log into index" },
+	{ "checkpoint", OPT_CHECKPOINT, "FILE", 0, "Save processed files in FILE" },
+	{ "resume",     OPT_RESUME, "failed", OPTION_ARG_OPTIONAL, "Skip files done in checkpoint, or only retry failed ones" },
+	{ "sync",        OPT_SYNC,  "SRC",   0, "Copy tags and names of SRC files to the same files in FILE directories" },
+	{ "delta",       OPT_DELTA, "DELTA", 0, "Write changes made by --sync in DELTA" },
+	{ "apply-delta", OPT_APPLY, "DELTA", 0, "Apply changes from DELTA to files in FILE directories" },
+	{ "shard",       OPT_SHARD, "I/N",   0, "Only process the I-th of N parts of files" },
 	{ 0, 0, 0, 0, "Field selection :", 10 },
 	{ "all",      'a', 0,             0,                   "Print all tags"                   },
 	{ "song",     'S', "SONG_TITLE",  OPTION_ARG_OPTIONAL, "Print/Set song title"             },
@@ -169,6 +269,80 @@ static error_t parse_opt( int key, char *arg, struct argp_state *state )
 		case 'v':
 			arguments->verbose = 1;
 			break;
+		case OPT_OUTPUT_DIR:
+			arguments->output_dir = arg;
+			break;
+		case OPT_JOURNAL:
+			arguments->journal = arg;
+			break;
+		case OPT_UNDO:
+			arguments->undo = arg;
+			break;
+		case OPT_INDEX:
+			arguments->index = arg;
+			break;
+		case OPT_SEARCH:
+			arguments->search = arg;
+			break;
+		case OPT_FUZZY:
+			arguments->fuzzy = 1;
+			break;
+		case OPT_COMPACT:
+			arguments->compact = 1;
+			break;
+		case OPT_CHECKPOINT:
+			arguments->checkpoint = arg;
+			break;
+		case OPT_RESUME:
+			if ( arg == NULL )
+				arguments->resume = RESUME_ALL;
+			else if ( strcmp( arg, "failed" ) == 0 )
+				arguments->resume = RESUME_FAILED;
+			else
+				argp_error( state, "unknown resume mode '%s'", arg );
+			break;
+		case OPT_SYNC:
+			arguments->sync = arg;
+			break;
+		case OPT_DELTA:
+			arguments->delta = arg;
+			break;
+		case OPT_APPLY:
+			arguments->apply_delta = arg;
+			break;
+		case OPT_FILES_FROM:
+			arguments->files_from = arg;
+			break;
+		case '0':
+			arguments->null = 1;
+			break;
+		case OPT_OP:
+			if ( arguments->op_count == MAX_OPS )
+				argp_error( state, "too many operations" );
+			if ( strcmp( arg, "get" ) == 0 )
+				arguments->ops[arguments->op_count++] = OP_GET;
+			else if ( strcmp( arg, "set" ) == 0 )
+				arguments->ops[arguments->op_count++] = OP_SET;
+			else if ( strcmp( arg, "rename" ) == 0 )
+				arguments->ops[arguments->op_count++] = OP_RENAME;
+			else if ( strcmp( arg, "print" ) == 0 )
+				arguments->ops[arguments->op_count++] = OP_PRINT;
+			else
+				argp_error( state, "unknown operation '%s'", arg );
+			break;
+		case OPT_SHARD: {
+			char *end;
+
+			arguments->shard = strtoul( arg, &end, 10 );
+			if ( *end != '/' || ( arguments->shards = strtoul( end + 1, &end, 10 ) ) == 0
+			  || *end != '\0' || arguments->shard >= arguments->shards )
+				argp_error( state, "invalid shard '%s', must be I/N with 0 <= I < N", arg );
+			break;
+		}
+		case OPT_CHARSET:
+			if ( ( arguments->charset = charset_from_name( arg ) ) < 0 )
+				argp_error( state, "unknown charset '%s'", arg );
+			break;
 		case 'a':
 			arguments->all = 1;
 			tags[I_SONG_TITLE].enabled = 1;
@@ -184,80 +358,52 @@ static error_t parse_opt( int key, char *arg, struct argp_state *state )
 			break;
 		case 'S':
 			tags[I_SONG_TITLE].enabled = 1;
-			if ( arg )
-				tags[I_SONG_TITLE].new_value = arg;
-			else
-				tags[I_SONG_TITLE].new_value = "";
+			tags[I_SONG_TITLE].new_value = arg;
 			break;
 		case 'G':
 			tags[I_GAME_TITLE].enabled = 1;
-			if ( arg )
-				tags[I_GAME_TITLE].new_value = arg;
-			else
-				tags[I_GAME_TITLE].new_value = "";
+			tags[I_GAME_TITLE].new_value = arg;
 			break;
 		case 'N':
 			tags[I_DUMPER_NAME].enabled = 1;
-			if ( arg )
-				tags[I_DUMPER_NAME].new_value = arg;
-			else
-				tags[I_DUMPER_NAME].new_value = "";
+			tags[I_DUMPER_NAME].new_value = arg;
 			break;
 		case 'C':
 			tags[I_COMMENTS].enabled = 1;
-			if ( arg )
-				tags[I_COMMENTS].new_value = arg;
-			else
-				tags[I_COMMENTS].new_value = "";
+			tags[I_COMMENTS].new_value = arg;
 			break;
 		case 'D':
 			tags[I_DUMP_DATE].enabled = 1;
-			if ( arg )
-				tags[I_DUMP_DATE].new_value = arg;
-			else
-				tags[I_DUMP_DATE].new_value = "";
+			tags[I_DUMP_DATE].new_value = arg;
 			break;
 		case 'L':
 			tags[I_LENGTH].enabled = 1;
-			if ( arg )
-				tags[I_LENGTH].new_value = arg;
-			else
-				tags[I_LENGTH].new_value = "";
+			tags[I_LENGTH].new_value = arg;
 			break;
 		case 'F':
 			tags[I_FADE_LENGTH].enabled = 1;
-			if ( arg )
-				tags[I_FADE_LENGTH].new_value = arg;
-			else
-				tags[I_FADE_LENGTH].new_value = "";
+			tags[I_FADE_LENGTH].new_value = arg;
 			break;
 		case 'A':
 			tags[I_ARTIST].enabled = 1;
-			if ( arg )
-				tags[I_ARTIST].new_value = arg;
-			else
-				tags[I_ARTIST].new_value = "";
+			tags[I_ARTIST].new_value = arg;
 			break;
 		case 'M':
 			tags[I_CHANNELS].enabled = 1;
-			if ( arg )
-				tags[I_CHANNELS].new_value = arg;
-			else
-				tags[I_CHANNELS].new_value = "";
+			tags[I_CHANNELS].new_value = arg;
 			break;
 		case 'E':
 			tags[I_EMULATOR].enabled = 1;
-			if ( arg )
-				tags[I_EMULATOR].new_value = arg;
-			else
-				tags[I_EMULATOR].new_value = "";
+			tags[I_EMULATOR].new_value = arg;
 			break;
 		case ARGP_KEY_INIT:
 			arguments->argz = 0;
 			arguments->argz_len = 0;
 			break;
 		case ARGP_KEY_NO_ARGS:
-			argp_usage (state);
+			/* Undo, search and compaction do not need any file name, it can be read from a file */
+			if ( ! arguments->undo && ! arguments->search && ! arguments->compact && ! arguments->files_from )
+				argp_usage (state);
 			break;
 		case ARGP_KEY_ARG:
 			argz_add( &arguments->argz, &arguments->argz_len, arg );
@@ -271,12 +417,18 @@ static error_t parse_opt( int key, char *arg, struct argp_state *state )
 
 static struct argp argp = { options, parse_opt, args_doc, doc };
 struct arguments arguments;		/* Our arguments     */
+FILE *files_from = NULL;		/* List of file names */
 
 
 int main( int argc, char **argv )
 {
 	FILE *file;			/* Our SPC file      */
+	char *input;			/* Input file name   */
 	char *filename;			/* File name to open */
+	char mirror_filename[MAX_FILENAME_LENGTH];
+	char abs_filename[MAX_FILENAME_LENGTH];		/* Absolute file name, for journal and index */
+	char abs_renamed[2 * MAX_FILENAME_LENGTH];	/* Absolute file name after renaming         */
+	char renamed[MAX_FILENAME_LENGTH];		/* File name after renaming            */
 	const char *prev = NULL;
 	int ret;
 
@@ -291,6 +443,23 @@ int main( int argc, char **argv )
 	arguments.no_error   = 0;
 	arguments.verbose    = 0;
 	arguments.all        = 0;
+	arguments.output_dir = NULL;
+	arguments.journal    = NULL;
+	arguments.undo       = NULL;
+	arguments.charset    = CHARSET_AUTO;
+	arguments.index      = NULL;
+	arguments.search     = NULL;
+	arguments.fuzzy      = 0;
+	arguments.compact    = 0;
+	arguments.checkpoint = NULL;
+	arguments.resume     = RESUME_NONE;
+	arguments.sync       = NULL;
+	arguments.delta      = NULL;
+	arguments.apply_delta = NULL;
+	arguments.shards     = 0;
+	arguments.op_count   = 0;
+	arguments.files_from = NULL;
+	arguments.null       = 0;
 
 	/* Parse arguments */
 	argp_parse( &argp, argc, argv, 0, 0, &arguments );
@@ -300,29 +469,242 @@ int main( int argc, char **argv )
 		printf( "Version: %s\n", argp_program_version );
 	}
 
-	/* Print an error message if the user use --get and --set at the same time */
-	if ( arguments.set && arguments.get ) {
-		fprintf( stderr, "You can not use get and set operations at the same time !\n" );
+	/* Undo a previous run */
+	if ( arguments.undo ) {
+		ret = undo_journal( arguments.undo );
+		free( arguments.argz );
+		return( ret );
+	}
+
+	/* Search index */
+	if ( arguments.search ) {
+		if ( ! arguments.index ) {
+			fprintf( stderr, "You must give an index to search with --index !\n" );
+			exit( E_WRONG_ARG );
+		}
+		ret = index_search( arguments.index, arguments.search, arguments.fuzzy );
+		free( arguments.argz );
+		return( ret );
+	}
+
+	/* Compact index */
+	if ( arguments.compact ) {
+		if ( ! arguments.index ) {
+			fprintf( stderr, "You must give an index to compact with --index !\n" );
+			exit( E_WRONG_ARG );
+		}
+		if ( ( ret = index_open( arguments.index ) ) == 0 )
+			ret = index_compact();
+		free( arguments.argz );
+		return( ret );
+	}
+
+	if ( arguments.op_count > 0 ) {
+		int i;
+
+		/* Print an error message if the user use --op with --get or --set */
+		if ( arguments.set || arguments.get ) {
+			fprintf( stderr, "You can not use --op with --get or --set !\n" );
+			exit( E_WRONG_ARG );
+		}
+
+		/* Files are only modified by set and rename operations */
+		arguments.rename = 0;
+		for ( i=0; i<arguments.op_count; i++ ) {
+			if ( arguments.ops[i] == OP_SET )
+				arguments.set = 1;
+			if ( arguments.ops[i] == OP_RENAME ) {
+				if ( ! arguments.rename_format ) {
+					fprintf( stderr, "You must give a format with --rename to use --op rename !\n" );
+					exit( E_WRONG_ARG );
+				}
+				arguments.rename = 1;
+			}
+		}
+	} else {
+		int i;
+
+		/* Print an error message if the user use --get and --set at the same time */
+		if ( arguments.set && arguments.get ) {
+			fprintf( stderr, "You can not use get and set operations at the same time !\n" );
+			exit( E_WRONG_ARG );
+		}
+		/* If no --set or --get are used, only print tags */
+		if ( ! arguments.set && ! arguments.get )
+			arguments.get = 1;
+
+		/* Print an error message if the user use --all and --set at the same time */
+		if ( arguments.all && arguments.set ) {
+			fprintf( stderr, "You can not use --all and --set at the same time !\n" );
+			exit( E_WRONG_ARG );
+		}
+
+		/* Delete fields selected without value */
+		if ( arguments.set ) {
+			for ( i=0; i<sizeof(tags)/sizeof(tag_params); i++ ) {
+				if ( tags[i].enabled && tags[i].new_value == NULL )
+					tags[i].new_value = "";
+			}
+		}
+
+		/* Get or set, then rename */
+		arguments.ops[arguments.op_count++] = arguments.set ? OP_SET : OP_GET;
+		if ( arguments.rename )
+			arguments.ops[arguments.op_count++] = OP_RENAME;
+	}
+
+	/* Convert new values from UTF-8 to the charset of tags */
+	if ( arguments.set && ( arguments.charset == CHARSET_LATIN1 || arguments.charset == CHARSET_SJIS ) ) {
+		int i;
+
+		for ( i=0; i<sizeof(tags)/sizeof(tag_params); i++ ) {
+			char buffer[CHARSET_BUFFER_SIZE];
+
+			if ( tags[i].new_value == NULL )
+				continue;
+			tags[i].new_value = strdup( charset_from_utf8( tags[i].new_value, arguments.charset, buffer ) );
+		}
+	}
+
+	/* Create output directory and use its absolute path */
+	if ( arguments.output_dir ) {
+		char *output_dir;
+
+		if ( ( make_dirs( arguments.output_dir ) ) != 0 )
+			exit( E_CREATE_DIR );
+		if ( ( output_dir = realpath( arguments.output_dir, NULL ) ) == NULL ) {
+			perror( "Can not resolve output directory!" );
+			exit( E_OPEN_DIR );
+		}
+		arguments.output_dir = output_dir;
+	}
+
+	/* Print an error message if the user use --sync and --apply-delta at the same time */
+	if ( arguments.sync && arguments.apply_delta ) {
+		fprintf( stderr, "You can not use --sync and --apply-delta at the same time !\n" );
 		exit( E_WRONG_ARG );
 	}
-	/* If no --set or --get are used, only print tags */
-	if ( ! arguments.set && ! arguments.get )
-		arguments.get = 1;
+	if ( arguments.delta && ! arguments.sync ) {
+		fprintf( stderr, "You can only use --delta with --sync !\n" );
+		exit( E_WRONG_ARG );
+	}
+
+	/* Open the journal, only needed if files are modified */
+	if ( arguments.journal && ( arguments.set || arguments.rename || arguments.sync || arguments.apply_delta ) ) {
+		if ( ( ret = journal_open( arguments.journal ) ) != 0 )
+			exit( ret );
+		atexit( commit_journal );
+	} else {
+		arguments.journal = NULL;
+	}
 
-	/* Print an error message if the user use --all and --set at the same time */
-	if ( arguments.all && arguments.set ) {
-		fprintf( stderr, "You can not use --all and --set at the same time !\n" );
+	/* Open checkpoint file, and load it to resume a previous run */
+	if ( arguments.resume && ! arguments.checkpoint ) {
+		fprintf( stderr, "You must give a checkpoint file to resume with --checkpoint !\n" );
 		exit( E_WRONG_ARG );
 	}
+	if ( arguments.checkpoint ) {
+		if ( ( ret = checkpoint_open( arguments.checkpoint, arguments.resume ) ) != 0 )
+			exit( ret );
+		atexit( commit_checkpoint );
+	}
+
+	/* Load the index to update */
+	if ( arguments.index ) {
+		if ( ( ret = index_open( arguments.index ) ) != 0 )
+			exit( ret );
+		atexit( save_index );
+	}
+
+	/* Open the list of file names */
+	if ( arguments.files_from ) {
+		if ( strcmp( arguments.files_from, "-" ) == 0 ) {
+			files_from = stdin;
+		} else if ( ( files_from = fopen( arguments.files_from, "r" ) ) == NULL ) {
+			perror( "Unable to open file names list!" );
+			exit( E_OPEN_FILE );
+		}
+	}
+
+	/* Sync directories with a reference directory or a delta file */
+	if ( arguments.sync || arguments.apply_delta ) {
+		if ( arguments.sync )
+			ret = load_sync_source( arguments.sync );
+		else
+			ret = sync_delta_load( arguments.apply_delta );
+		if ( ret != 0 )
+			exit( ret );
+
+		if ( arguments.delta && ( ret = sync_delta_open( arguments.delta ) ) != 0 )
+			exit( ret );
+
+		while( ( input = next_input( prev ) ) ) {
+			prev = input;
+			checkpoint_start( input );
+			if ( ( ret = sync_tree( input ) ) != 0 )
+				exit_or_cont( ret );
+			checkpoint_done();
+		}
+
+		free( arguments.argz );
+
+		return( sync_delta_close() );
+	}
+
+	while( ( input = next_input( prev ) ) ) {
+		char msgerror[strlen( input ) + MAX_FILENAME_LENGTH + 1024];	/* Error string */
+
+		filename = input;
+
+		/* Skip inputs of other shards */
+		if ( ! in_shard( input ) ) {
+			prev = input;
+			continue;
+		}
+
+		/* Skip inputs already processed by a previous run */
+		if ( arguments.resume ) {
+			int status = checkpoint_status( input );
+
+			if ( status == CHECKPOINT_DONE || ( arguments.resume == RESUME_FAILED && status != CHECKPOINT_FAILED ) ) {
+				if ( arguments.verbose )
+					printf( "Skip %s\n", input );
+				prev = input;
+				continue;
+			}
+		}
+		checkpoint_start( input );
 
-	while( ( filename = argz_next( arguments.argz, arguments.argz_len, prev ) ) ) {
-		char msgerror[strlen( filename ) + 1024];	/* Error string */
+		/* Work on a copy of the file if it must be modified */
+		if ( arguments.output_dir && ( arguments.set || arguments.rename ) ) {
+			if ( ( ret = mirror_file( input, mirror_filename ) ) != 0 ) {
+				fprintf( stderr, "Can not copy %s to output directory!\n", input );
+				prev = input;
+				exit_or_cont( ret );
+			}
+			filename = mirror_filename;
+		}
 
 		/* Open file */
 		if ( ( file = fopen( filename, "r+" ) ) == NULL ) {
 			sprintf( msgerror, "Unable to open file '%s'!", filename );
 			perror( msgerror );
-			prev = filename;
+			prev = input;
+			exit_or_cont( E_OPEN_FILE );
+		}
+
+		/* Wait for other espctag processes using this file */
+		if ( ( ret = lock_file( &file, filename, arguments.set || arguments.rename ? F_WRLCK : F_RDLCK ) ) != 0 ) {
+			prev = input;
+			exit_or_cont( ret );
+		}
+
+		/* Journal, index and RSN files need a name which does not depend on cwd */
+		if ( realpath( filename, abs_filename ) == NULL ) {
+			sprintf( msgerror, "Can not resolve file name '%s'!", filename );
+			perror( msgerror );
+			fclose( file );
+			prev = input;
 			exit_or_cont( E_OPEN_FILE );
 		}
 
@@ -340,7 +722,8 @@ int main( int argc, char **argv )
 			if( ( tmp_dirname = mkdtemp ( dir_template ) ) == NULL ) {
 				perror( "Unable to create temp directory!" );
 				free( cur_dirname );
-				prev = filename;
+				fclose( file );
+				prev = input;
 				exit_or_cont( E_CREATE_DIR );
 			}
 
@@ -349,7 +732,8 @@ int main( int argc, char **argv )
 				fprintf( stderr, "%s extraction failed!\n", filename );
 				del_tmp_dir( tmp_dirname );
 				free( cur_dirname );
-				prev = filename;
+				fclose( file );
+				prev = input;
 				exit_or_cont( ret );
 			}
 
@@ -358,7 +742,8 @@ int main( int argc, char **argv )
 				perror( "Can not change to temp directory!" );
 				del_tmp_dir( tmp_dirname );
 				free( cur_dirname );
-				prev = filename;
+				fclose( file );
+				prev = input;
 				exit_or_cont( E_CH_DIR );
 			}
 			/* Open tmp directory */
@@ -367,7 +752,8 @@ int main( int argc, char **argv )
 				chdir( cur_dirname );
 				free( cur_dirname );
 				del_tmp_dir( tmp_dirname );
-				prev = filename;
+				fclose( file );
+				prev = input;
 				exit_or_cont( E_OPEN_DIR );
 			}
 			/* Process all SPC files */
@@ -398,13 +784,16 @@ int main( int argc, char **argv )
 				}
 
 				/* Process SPC file */
-				process_spc_file( spc_file );
+				ret = process_spc_file( spc_file, dir_entry->d_name, abs_filename, dir_entry->d_name, renamed );
 
 				/* Close file */
 				fclose( spc_file );
 
-				/* Rename file */
-				if( ( ret = rename_spc_file( dir_entry->d_name ) ) != 0 ) {
+				/* Update search index */
+				if ( arguments.index )
+					index_spc_file( abs_filename, dir_entry->d_name, abs_filename, renamed );
+
+				if( ret != 0 ) {
 					spctag_free();
 					exit_or_cont( ret );
 				}
@@ -416,40 +805,28 @@ int main( int argc, char **argv )
 			/* Close tmp directory */
 			closedir( tmp_dir );
 
-			/* Close RSN file */
-			fclose( file );
-
-			/* Repack file */
+			/* Repack file. RSN file stays opened to keep its lock. Backup
+			   original RSN file (useless if we work on a copy). */
 			if( arguments.set || arguments.rename ) {
-				/* Backup original RSN file */
-				if( arguments.backup_rsn ) {
-					if( ( ret = backup_rsn_file( filename ) ) != 0 ) {
-						fprintf( stderr, "Can not backup %s!\n", filename );
-						chdir( cur_dirname );
-						free( cur_dirname );
-						del_tmp_dir( tmp_dirname );
-						prev = filename;
-						exit_or_cont( ret );
-					}
-				} else 
-					/* Delete RSN file */
-					unlink( filename );
-				/* Compress RSN FILE */
-				if( ( ret = pack_rsn_file( filename, tmp_dirname ) ) != 0 ) {
+				if( ( ret = repack_rsn_file( abs_filename, tmp_dirname, arguments.backup_rsn && ! arguments.output_dir ) ) != 0 ) {
 					fprintf( stderr, "%s compression failed!\n", filename );
 					chdir( cur_dirname );
 					free( cur_dirname );
 					del_tmp_dir( tmp_dirname );
-					prev = filename;
+					fclose( file );
+					prev = input;
 					exit_or_cont( ret );
 				}
 			}
 
+			/* Close RSN file */
+			fclose( file );
+
 			/* Delete temp directory */
 			if( ( ret = del_tmp_dir( tmp_dirname ) ) != 0 ) {
 				chdir( cur_dirname );
 				free( cur_dirname );
-				prev = filename;
+				prev = input;
 				exit_or_cont( ret );
 			}
 
@@ -457,7 +834,7 @@ int main( int argc, char **argv )
 			if( chdir( cur_dirname ) != 0 ) {
 				perror( "Can not change from temp directory!" );
 				free( cur_dirname );
-				prev = filename;
+				prev = input;
 				exit_or_cont( E_CH_DIR );
 			}
 
@@ -472,20 +849,31 @@ int main( int argc, char **argv )
 			if ( ( ret = spctag_init( file ) ) < 0 ) {
 				fprintf( stderr, "Can not init libspctag!\n" );
 				fclose( file );
-				prev = filename;
+				prev = input;
 				exit_or_cont( ret );
 			}
 		
 			/* Process SPC file */
-			process_spc_file( file );
+			ret = process_spc_file( file, filename, "", abs_filename, renamed );
 
 			/* Close file */
 			fclose( file );
 
-			/* Rename file */
-			if( ( ret = rename_spc_file( filename ) ) != 0 ) {
+			/* Get absolute file name after renaming */
+			if ( arguments.index ) {
+				char *abs_dirname = strdup( abs_filename );
+
+				snprintf( abs_renamed, sizeof( abs_renamed ), "%s/%s", dirname( abs_dirname ), renamed );
+				free( abs_dirname );
+			}
+
+			/* Update search index */
+			if ( arguments.index )
+				index_spc_file( abs_filename, "", abs_renamed, "" );
+
+			if( ret != 0 ) {
 				spctag_free();
-				prev = filename;
+				prev = input;
 				exit_or_cont( ret );
 			}
 
@@ -493,7 +881,8 @@ int main( int argc, char **argv )
 			spctag_free();
 		}
 
-		prev = filename;
+		checkpoint_done();
+		prev = input;
 	}
 
 	/* Free argz memory */
@@ -502,41 +891,123 @@ int main( int argc, char **argv )
 	return( SUCCESS );
 }
 
-void process_spc_file( FILE *spc_file )
+int process_spc_file( FILE *spc_file, char *file, char *archive, char *journal_name, char *renamed )
 {
-	int i;
+	char current[2 * MAX_FILENAME_LENGTH];		/* File name after previous operations */
+	char journal_current[2 * MAX_FILENAME_LENGTH];	/* Same name, as saved in the journal  */
+	char journal_renamed[2 * MAX_FILENAME_LENGTH];
+	char new_filename[MAX_FILENAME_LENGTH + 1];	/* Always '\0' terminated */
+	char *file_path = strdup( file );
+	int i, ret;
+
+	strcpy( renamed, basename( file_path ) );
+	free( file_path );
+	strcpy( current, file );
+	if ( arguments.journal )
+		strcpy( journal_current, journal_name );
 
 	/* Print tag type (text or binary) */
 	print_tag_type();
 
+	/* Do all operations while the file is opened */
+	for ( i=0; i<arguments.op_count; i++ ) {
+		switch ( arguments.ops[i] ) {
+			case OP_GET:
+				print_tags( 0 );
+				break;
+			case OP_PRINT:
+				print_tags( 1 );
+				break;
+			case OP_SET:
+				/* Undo data is saved before the file is changed */
+				if ( ( ret = journal_spc_file( spc_file, archive, journal_current, journal_current ) ) != 0 )
+					return( ret );
+				set_tags( spc_file );
+				break;
+			case OP_RENAME:
+				/* get_new_filename() appends to a zeroed buffer */
+				memset( new_filename, 0, sizeof( new_filename ) );
+				get_new_filename( new_filename, arguments.rename_format );
+				if ( arguments.verbose )
+					printf( "New file name: %s\n", new_filename );
+
+				if ( arguments.journal ) {
+					/* Members of RSN files are saved without directory */
+					if ( archive[0] != '\0' ) {
+						strcpy( journal_renamed, new_filename );
+					} else {
+						file_path = strdup( journal_current );
+						snprintf( journal_renamed, sizeof( journal_renamed ), "%s/%s", dirname( file_path ), new_filename );
+						free( file_path );
+					}
+					if ( ( ret = journal_spc_file( spc_file, archive, journal_current, journal_renamed ) ) != 0 )
+						return( ret );
+					strcpy( journal_current, journal_renamed );
+				}
+
+				if ( ( ret = rename_spc_file( current, new_filename ) ) != 0 )
+					return( ret );
+				strcpy( renamed, new_filename );
+
+				/* Next operations use the new name */
+				file_path = strdup( current );
+				snprintf( current, sizeof( current ), "%s/%s", dirname( file_path ), renamed );
+				free( file_path );
+				break;
+		}
+	}
+
+	return( 0 );
+}
+
+void print_tags( int all )
+{
+	char buffer[CHARSET_BUFFER_SIZE];
+	int i;
+
 	/* For every know tag ... */
 	for ( i=0; i<sizeof(tags)/sizeof(tag_params); i++ ) {
 		/* Do nothing if the tag is not selected */
-		if ( ! tags[i].enabled )
+		if ( ! all && ! tags[i].enabled )
 			continue;
 
-		/* Print or set tag */
-		if ( arguments.set ) {
-			if ( arguments.verbose ) {
-				printf(
-					"Change %s from \"%s\" to \"%s\"\n",
-					tags[i].label,
-					tags[i].get_func(),
-					tags[i].new_value
-				);
-			}
-			tags[i].set_func( tags[i].new_value );
-		} else {
-			if ( arguments.field_name )
-				printf( "%s : ", tags[i].label );
+		if ( arguments.field_name )
+			printf( "%s : ", tags[i].label );
+
+		printf( "%s\n", get_tag( i, buffer ) );
+	}
+}
+
+void set_tags( FILE *spc_file )
+{
+	char buffer[CHARSET_BUFFER_SIZE];
+	int i;
+
+	/* For every know tag ... */
+	for ( i=0; i<sizeof(tags)/sizeof(tag_params); i++ ) {
+		/* Do nothing if the tag is not selected or has no new value (--all) */
+		if ( ! tags[i].enabled || tags[i].new_value == NULL )
+			continue;
 
-			printf( "%s\n", tags[i].get_func() );
+		if ( arguments.verbose ) {
+			printf(
+				"Change %s from \"%s\" to \"%s\"\n",
+				tags[i].label,
+				get_tag( i, buffer ),
+				tags[i].new_value
+			);
 		}
+		tags[i].set_func( tags[i].new_value );
 	}
 
-	/* Save the file if something have been set */
-	if ( arguments.set )
-		spctag_save( spc_file );
+	/* Save the file */
+	spctag_save( spc_file );
+}
+
+char *get_tag( int index, char *buffer )
+{
+	/* Tags are always printed in UTF-8 */
+	return( charset_to_utf8( tags[index].get_func(), arguments.charset, buffer ) );
 }
 
 void print_tag_type()
@@ -549,38 +1020,42 @@ void print_tag_type()
 	}
 }
 
-int rename_spc_file ( char* file )
+int rename_spc_file ( char* file, char *new_filename )
 {
-	if ( arguments.rename ) {
-		char msgerror[strlen( file ) + 1024];	/* Error string */
-
-		/* Get dirname */
-		char *file_path = strdup( file );
-		char *dir_name = dirname( file_path );
+	char msgerror[strlen( file ) + 1024];	/* Error string */
+
+	/* Get dirname */
+	char *file_path = strdup( file );
+	char *dir_name = dirname( file_path );
+
+	/* Rename file */
+	char new_filepath[strlen( dir_name ) + strlen( new_filename ) + 2];
+	strcpy( new_filepath, dir_name );
+	strcat( new_filepath, "/" );
+	strcat( new_filepath, new_filename );
+	free( file_path );
+	if( ( rename( file, new_filepath ) ) != 0 ) {
+		sprintf( msgerror, "Can not rename file '%s'", file );
+		perror( msgerror );
+		return( E_RENAME_FILE );
+	}
 
-		/* Get new file name */
-		char new_filename[MAX_FILENAME_LENGTH] = "\0";
-		get_new_filename( new_filename, arguments.rename_format );
+	return( 0 );
+}
 
-		if( arguments.verbose ) {
-			printf( "New file name: %s\n", new_filename );
-		}
+int journal_spc_file ( FILE *spc_file, char *archive, char *old_name, char *new_name )
+{
+	unsigned char header[JOURNAL_HEADER_SIZE];
+	int ret;
 
-		/* Rename file */
-		char new_filepath[strlen( dir_name ) + strlen( new_filename ) + 2];
-		strcpy( new_filepath, dir_name );
-		strcat( new_filepath, "/" );
-		strcat( new_filepath, new_filename );
-		if( ( rename( file, new_filepath ) ) != 0 ) {
-			sprintf( msgerror, "Can not rename file '%s'", file );
-			perror( msgerror );
-			return( E_RENAME_FILE );
-		}
+	if( ! arguments.journal )
+		return( 0 );
 
-		free( file_path );
-	}
+	/* The record is flushed before the caller changes anything */
+	if( ( ret = journal_read_header( spc_file, header ) ) != 0 )
+		return( ret );
 
-	return( 0 );
+	return( journal_add( archive, old_name, new_name, header ) );
 }
 
 char *get_new_filename( char *new_filename, char* rename_format )
@@ -590,7 +1065,8 @@ char *get_new_filename( char *new_filename, char* rename_format )
 
 	for( c=0; c<strlen( rename_format ); c++ ) {
 		if( rename_format[c] == '%' ) {
-			char* (*get_func)();
+			char tmp_tag[CHARSET_BUFFER_SIZE];
+			int index;
 			int to_upper = 0;
 			int to_lower = 0;
 			char slength[2] = "\0\0";
@@ -620,16 +1096,16 @@ char *get_new_filename( char *new_filename, char* rename_format )
 			length = atoi( slength );
 
 			switch( rename_format[c] ) {
-				case 's': get_func = tags[I_SONG_TITLE].get_func;  break;
-				case 'g': get_func = tags[I_GAME_TITLE].get_func;  break;
-				case 'n': get_func = tags[I_DUMPER_NAME].get_func; break;
-				case 'c': get_func = tags[I_COMMENTS].get_func;    break;
-				case 'd': get_func = tags[I_DUMP_DATE].get_func;   break;
-				case 'l': get_func = tags[I_LENGTH].get_func;      break;
-				case 'f': get_func = tags[I_FADE_LENGTH].get_func; break;
-				case 'a': get_func = tags[I_ARTIST].get_func;      break;
-				case 'm': get_func = tags[I_CHANNELS].get_func;    break;
-				case 'e': get_func = tags[I_EMULATOR].get_func;    break;
+				case 's': index = I_SONG_TITLE;  break;
+				case 'g': index = I_GAME_TITLE;  break;
+				case 'n': index = I_DUMPER_NAME; break;
+				case 'c': index = I_COMMENTS;    break;
+				case 'd': index = I_DUMP_DATE;   break;
+				case 'l': index = I_LENGTH;      break;
+				case 'f': index = I_FADE_LENGTH; break;
+				case 'a': index = I_ARTIST;      break;
+				case 'm': index = I_CHANNELS;    break;
+				case 'e': index = I_EMULATOR;    break;
 				case '%':
 					if( strlen( new_filename ) < MAX_FILENAME_LENGTH )
 						new_filename[strlen( new_filename )] = rename_format[c];
@@ -640,18 +1116,24 @@ char *get_new_filename( char *new_filename, char* rename_format )
 					exit( E_WRONG_ARG );
 			}
 
-			char *tmp_tag = get_func();
+			get_tag( index, tmp_tag );
 
-			if ( to_upper ) {
-				int i;
-				for( i=0; i<strlen( tmp_tag ); i++ ) {
-					tmp_tag[i] = toupper( tmp_tag[i] );
-				}
-			} else if ( to_lower ) {
-				int i;
-				for( i=0; i<strlen( tmp_tag ); i++ ) {
-					tmp_tag[i] = tolower( tmp_tag[i] );
+			if ( to_upper )
+				charset_toupper( tmp_tag );
+			else if ( to_lower )
+				charset_tolower( tmp_tag );
+
+			/* Max width is a number of characters, don't cut UTF-8 sequences */
+			if ( length > 0 ) {
+				int chars = 0;
+				char *end;
+
+				for( end=tmp_tag; *end; end++ ) {
+					if( ( *end & 0xC0 ) != 0x80 && chars++ == length )
+						break;
 				}
+				*end = '\0';
+				length = 0;
 			}
 
 			int i;
@@ -680,6 +1162,330 @@ char *get_new_filename( char *new_filename, char* rename_format )
 	return( new_filename );
 }
 
+void commit_journal()
+{
+	journal_commit();
+}
+
+void index_spc_file( char *old_path, char *old_member, char *path, char *member )
+{
+	/* Fields which can be searched */
+	static const int fields[] = { I_SONG_TITLE, I_GAME_TITLE, I_ARTIST, I_DUMPER_NAME, I_COMMENTS };
+	char text[CHARSET_BUFFER_SIZE] = "";
+	char buffer[CHARSET_BUFFER_SIZE];
+	int i;
+
+	for ( i=0; i<sizeof(fields)/sizeof(int); i++ ) {
+		get_tag( fields[i], buffer );
+		if ( strlen( text ) + strlen( buffer ) + 2 > sizeof( text ) )
+			break;
+		strcat( text, buffer );
+		strcat( text, "\n" );
+	}
+
+	/* Forget the old name of renamed files */
+	if ( strcmp( old_path, path ) != 0 || strcmp( old_member, member ) != 0 )
+		index_remove( old_path, old_member );
+
+	index_update( path, member, text );
+}
+
+void save_index()
+{
+	index_save();
+}
+
+void commit_checkpoint()
+{
+	checkpoint_commit();
+}
+
+int load_sync_source ( char* dirname )
+{
+	char **files;
+	size_t count, i;
+	int ret;
+
+	if( ( files = sync_list_files( dirname, &count ) ) == NULL )
+		return( E_OPEN_DIR );
+
+	for( i=0; i<count; i++ ) {
+		sync_entry *entry;
+		uint64_t hash;
+		FILE *spc_file;
+		int j;
+
+		if( ( ret = sync_payload_hash( files[i], &hash ) ) != 0 )
+			exit_or_cont( ret );
+
+		if( ( spc_file = fopen( files[i], "r" ) ) == NULL ) {
+			perror( "Unable to open reference file!" );
+			exit_or_cont( E_OPEN_FILE );
+		}
+		if( ( ret = spctag_init( spc_file ) ) < 0 ) {
+			fprintf( stderr, "Can not init libspctag!\n" );
+			fclose( spc_file );
+			exit_or_cont( ret );
+		}
+
+		/* Save reference values */
+		entry = sync_find( hash, 1 );
+		for( j=0; j<SYNC_NAME; j++ ) {
+			free( entry->values[j] );
+			entry->values[j] = strdup( tags[j].get_func() );
+		}
+		free( entry->values[SYNC_NAME] );
+		entry->values[SYNC_NAME] = strdup( basename( files[i] ) );
+
+		spctag_free();
+		fclose( spc_file );
+	}
+
+	sync_free_files( files, count );
+
+	return( 0 );
+}
+
+int sync_tree ( char* dirname )
+{
+	char **files;
+	size_t count, i;
+	int ret;
+
+	if( ( files = sync_list_files( dirname, &count ) ) == NULL )
+		return( E_OPEN_DIR );
+
+	for( i=0; i<count; i++ ) {
+		sync_entry *entry;
+		uint64_t hash;
+
+		/* Ignore files of other shards, use a name which does not depend on mount point */
+		if( ! in_shard( files[i] + strlen( dirname ) ) )
+			continue;
+
+		if( ( ret = sync_payload_hash( files[i], &hash ) ) != 0 )
+			exit_or_cont( ret );
+
+		/* Ignore files which are not in the reference */
+		if( ( entry = sync_find( hash, 0 ) ) == NULL )
+			continue;
+
+		if( ( ret = sync_spc_file( files[i], entry ) ) != 0 )
+			exit_or_cont( ret );
+	}
+
+	sync_free_files( files, count );
+
+	return( 0 );
+}
+
+int sync_spc_file ( char* filename, sync_entry *entry )
+{
+	FILE *spc_file;
+	char abs_filename[MAX_FILENAME_LENGTH];
+	char new_filename[2 * MAX_FILENAME_LENGTH];
+	char buffer[CHARSET_BUFFER_SIZE];
+	char *file_path;
+	char *name = entry->values[SYNC_NAME];
+	int changed = 0;
+	int rename_file;
+	int ret = 0;
+	int i;
+
+	if( arguments.file_name || arguments.verbose )
+		printf( "File : %s\n", filename );
+
+	if( realpath( filename, abs_filename ) == NULL || ( spc_file = fopen( filename, "r+" ) ) == NULL ) {
+		perror( "Unable to open file!" );
+		return( E_OPEN_FILE );
+	}
+	if( ( ret = lock_file( &spc_file, filename, F_WRLCK ) ) != 0 )
+		return( ret );
+	if( ( ret = spctag_init( spc_file ) ) < 0 ) {
+		fprintf( stderr, "Can not init libspctag!\n" );
+		fclose( spc_file );
+		return( ret );
+	}
+	ret = 0;
+
+	/* Find what has to change */
+	for( i=0; i<SYNC_NAME; i++ ) {
+		if( entry->values[i] != NULL && strcmp( tags[i].get_func(), entry->values[i] ) != 0 )
+			changed = 1;
+	}
+	strcpy( new_filename, abs_filename );
+	file_path = strdup( abs_filename );
+	rename_file = name && name[0] && strchr( name, '/' ) == NULL && strcmp( basename( file_path ), name ) != 0;
+	free( file_path );
+	if( rename_file ) {
+		char *dir_path = strdup( abs_filename );
+
+		snprintf( new_filename, sizeof( new_filename ), "%s/%s", dirname( dir_path ), name );
+		free( dir_path );
+	}
+
+	/* Save undo data before the file is changed */
+	if( ( changed || rename_file ) && ( ret = journal_spc_file( spc_file, "", abs_filename, new_filename ) ) != 0 ) {
+		spctag_free();
+		fclose( spc_file );
+		return( ret );
+	}
+
+	/* Only write fields which differ */
+	for( i=0; i<SYNC_NAME; i++ ) {
+		if( entry->values[i] == NULL || strcmp( tags[i].get_func(), entry->values[i] ) == 0 )
+			continue;
+
+		if( arguments.verbose )
+			printf( "Change %s from \"%s\" to \"%s\"\n", tags[i].label, get_tag( i, buffer ), entry->values[i] );
+		tags[i].set_func( entry->values[i] );
+		if( ( ret = sync_delta_add( entry, i ) ) != 0 )
+			break;
+	}
+	if( changed )
+		spctag_save( spc_file );
+	fclose( spc_file );
+
+	/* Rename file */
+	if( ret == 0 && rename_file ) {
+		if( arguments.verbose )
+			printf( "New file name: %s\n", name );
+
+		if( access( new_filename, F_OK ) == 0 ) {
+			fprintf( stderr, "Can not rename file '%s': '%s' already exists\n", filename, name );
+			strcpy( new_filename, abs_filename );
+			ret = E_RENAME_FILE;
+		} else if( rename( abs_filename, new_filename ) != 0 ) {
+			perror( "Can not rename file" );
+			strcpy( new_filename, abs_filename );
+			ret = E_RENAME_FILE;
+		} else {
+			ret = sync_delta_add( entry, SYNC_NAME );
+		}
+	} else {
+		strcpy( new_filename, abs_filename );
+	}
+
+	/* Update search index */
+	if( ( changed || rename_file ) && arguments.index )
+		index_spc_file( abs_filename, "", new_filename, "" );
+
+	spctag_free();
+
+	return( ret );
+}
+
+int undo_journal ( char* filename )
+{
+	journal_entry *entries;
+	size_t count;
+	size_t i, j;
+	int ret;
+
+	if( ( entries = journal_load( filename, &count ) ) == NULL )
+		return( E_JOURNAL );
+
+	/* Replay the journal in reverse order */
+	for( i=count; i>0; i=j ) {
+		char *archive = entries[i-1].archive;
+		char dir_template[] = "/tmp/espctag-XXXXXX";
+		char *tmp_dirname = NULL;
+		char *cur_dirname = NULL;
+		FILE *archive_file = NULL;
+
+		ret = 0;
+
+		/* Group consecutive entries of the same RSN file, to repack it once */
+		for( j=i-1; j>0 && strcmp( entries[j-1].archive, archive ) == 0; j-- )
+			;
+		if( archive[0] == '\0' )
+			j = i - 1;
+
+		if( archive[0] != '\0' ) {
+			if( arguments.verbose )
+				printf( "Restore RSN file \"%s\"\n", archive );
+
+			/* Keep the RSN file locked until it is repacked */
+			if( ( archive_file = fopen( archive, "r+" ) ) == NULL ) {
+				perror( "Unable to open RSN file!" );
+				exit_or_cont( E_OPEN_FILE );
+			}
+			if( ( ret = lock_file( &archive_file, archive, F_WRLCK ) ) != 0 )
+				exit_or_cont( ret );
+
+			cur_dirname = getcwd( NULL, 0 );
+			if( ( tmp_dirname = mkdtemp ( dir_template ) ) == NULL ) {
+				perror( "Unable to create temp directory!" );
+				free( cur_dirname );
+				fclose( archive_file );
+				exit_or_cont( E_CREATE_DIR );
+			}
+			if( ( ret = unpack_rsn_file( archive, tmp_dirname ) ) != 0 ) {
+				fprintf( stderr, "%s extraction failed!\n", archive );
+				del_tmp_dir( tmp_dirname );
+				free( cur_dirname );
+				fclose( archive_file );
+				exit_or_cont( ret );
+			}
+			if( chdir( tmp_dirname ) != 0 ) {
+				perror( "Can not change to temp directory!" );
+				del_tmp_dir( tmp_dirname );
+				free( cur_dirname );
+				fclose( archive_file );
+				exit_or_cont( E_CH_DIR );
+			}
+		}
+
+		for( ; i>j; i-- ) {
+			journal_entry *entry = &entries[i-1];
+			FILE *spc_file;
+
+			if( arguments.verbose )
+				printf( "Restore \"%s\"\n", entry->old_name );
+
+			/* Restore file name. Records are written before renaming,
+			   so the file may not have been renamed. */
+			if( strcmp( entry->new_name, entry->old_name ) != 0 && access( entry->new_name, F_OK ) == 0 && access( entry->old_name, F_OK ) != 0 ) {
+				if( rename( entry->new_name, entry->old_name ) != 0 ) {
+					perror( "Can not restore file name!" );
+					ret = E_RENAME_FILE;
+					break;
+				}
+			}
+
+			/* Restore header */
+			if( ( spc_file = fopen( entry->old_name, "r+" ) ) == NULL
+			 || lock_file( &spc_file, entry->old_name, F_WRLCK ) != 0
+			 || fwrite( entry->header, JOURNAL_HEADER_SIZE, 1, spc_file ) != 1
+			 || fclose( spc_file ) != 0 ) {
+				perror( "Can not restore file header!" );
+				ret = E_OPEN_FILE;
+				break;
+			}
+			ret = 0;
+		}
+
+		if( archive[0] != '\0' ) {
+			if( ret == 0 && ( ret = repack_rsn_file( archive, tmp_dirname, 0 ) ) != 0 )
+				fprintf( stderr, "%s compression failed!\n", archive );
+			fclose( archive_file );
+			del_tmp_dir( tmp_dirname );
+			if( chdir( cur_dirname ) != 0 ) {
+				perror( "Can not change from temp directory!" );
+				ret = E_CH_DIR;
+			}
+			free( cur_dirname );
+		}
+
+		if( ret != 0 )
+			exit_or_cont( ret );
+	}
+
+	journal_free( entries, count );
+
+	return( SUCCESS );
+}
+
 int is_rsn_file ( FILE* file )
 {
 	char rar_number[] = { 0x52, 0x61, 0x72, 0x21, 0X1A, 0x07, 0x00 };
@@ -698,16 +1504,90 @@ int is_rsn_file ( FILE* file )
 	return 1;
 }
 
+char *next_input ( const char *prev )
+{
+	static int from_args = 1;	/* Non null until all arguments are read */
+	static char *line = NULL;	/* Last name read from files_from        */
+	static size_t size = 0;
+	ssize_t length;
+
+	/* File names given as arguments come first */
+	if( from_args ) {
+		char *input = argz_next( arguments.argz, arguments.argz_len, prev );
+
+		if( input )
+			return input;
+		from_args = 0;
+	}
+
+	if( files_from == NULL )
+		return NULL;
+
+	/* Then read names one by one, so they are processed as soon as they come */
+	while( ( length = getdelim( &line, &size, arguments.null ? '\0' : '\n', files_from ) ) > 0 ) {
+		if( line[length-1] == ( arguments.null ? '\0' : '\n' ) )
+			line[--length] = '\0';
+		if( length > 0 )
+			return line;
+	}
+
+	if( files_from != stdin )
+		fclose( files_from );
+	files_from = NULL;
+	free( line );
+	line = NULL;
+
+	return NULL;
+}
+
+int in_shard ( const char *path )
+{
+	if( arguments.shards == 0 )
+		return 1;
+
+	/* Hash of the name, stable between hosts and runs */
+	return( fnv1a( FNV1A_INIT, path, strlen( path ) ) % arguments.shards == arguments.shard );
+}
+
+int lock_file ( FILE **file, char *filename, short type )
+{
+	struct stat locked, current;
+	char msgerror[strlen( filename ) + 1024];	/* Error string */
+
+	for( ;; ) {
+		if( lock_fd( fileno( *file ), type ) != 0 ) {
+			sprintf( msgerror, "Can not lock file '%s'", filename );
+			perror( msgerror );
+			fclose( *file );
+			return( E_LOCK_FILE );
+		}
+
+		/* The file may have been replaced while we waited (RSN files are recreated) */
+		if( fstat( fileno( *file ), &locked ) == 0 && stat( filename, &current ) == 0
+		 && locked.st_dev == current.st_dev && locked.st_ino == current.st_ino )
+			return( 0 );
+
+		fclose( *file );
+		if( ( *file = fopen( filename, "r+" ) ) == NULL ) {
+			sprintf( msgerror, "Unable to open file '%s'!", filename );
+			perror( msgerror );
+			return( E_OPEN_FILE );
+		}
+	}
+}
+
 int backup_rsn_file ( char* filename )
 {
-	char backup_filename[strlen( filename + 4)];
-	strcat( backup_filename, filename );
+	char backup_filename[strlen( filename ) + 5];
+	strcpy( backup_filename, filename );
 	strcat( backup_filename, ".bak" );
 
 	if( arguments.verbose )
 		printf( "Save input RSN file as \"%s\"\n", backup_filename );
 
-	if( ( rename( filename, backup_filename ) ) != 0 ) {
+	/* Keep the original file in place until the new one replaces it */
+	unlink( backup_filename );
+	if( ( link( filename, backup_filename ) ) != 0 ) {
 		perror( "Can not backup file!" );
 		return( E_RENAME_FILE );
 	}
@@ -715,6 +1595,163 @@ int backup_rsn_file ( char* filename )
 	return( 0 );
 }
 
+int mirror_file ( char* filename, char *mirror_filename )
+{
+	char *path = filename;
+	char *dir_name;
+
+	/* Build the same relative path under the output directory, dropping
+	   leading '/' and any '.' component. A '..' component could give two
+	   inputs the same copy, or point outside of the output directory. */
+	strcpy( mirror_filename, arguments.output_dir );
+	while( *path ) {
+		size_t length = strcspn( path, "/" );
+
+		if( length == 2 && strncmp( path, "..", 2 ) == 0 ) {
+			fprintf( stderr, "Can not copy \"%s\" to output directory, '..' is not allowed in its name\n", filename );
+			return( E_WRONG_ARG );
+		}
+
+		if( length > 0 && strncmp( path, ".", length ) != 0 ) {
+			if( strlen( mirror_filename ) + length + 2 > MAX_FILENAME_LENGTH ) {
+				fprintf( stderr, "File name too long: %s\n", filename );
+				return( E_WRONG_ARG );
+			}
+			strcat( mirror_filename, "/" );
+			strncat( mirror_filename, path, length );
+		}
+
+		path += length;
+		if( *path == '/' )
+			path++;
+	}
+
+	/* Create parent directories */
+	dir_name = strdup( mirror_filename );
+	if( ( make_dirs( dirname( dir_name ) ) ) != 0 ) {
+		free( dir_name );
+		return( E_CREATE_DIR );
+	}
+	free( dir_name );
+
+	if( arguments.verbose )
+		printf( "Copy \"%s\" to \"%s\"\n", filename, mirror_filename );
+
+	return( clone_file( filename, mirror_filename ) );
+}
+
+int clone_file ( char *src, char *dest )
+{
+	char tmp_filename[strlen( dest ) + 8];
+	char buffer[65536];
+	struct stat st, dest_st;
+	int src_fd, dest_fd;
+	ssize_t count;
+
+	if( ( src_fd = open( src, O_RDONLY ) ) == -1 ) {
+		perror( "Can not open file to copy!" );
+		return( E_OPEN_FILE );
+	}
+	if( fstat( src_fd, &st ) != 0 ) {
+		perror( "Can not stat file to copy!" );
+		close( src_fd );
+		return( E_OPEN_FILE );
+	}
+
+	/* Never overwrite the input with its own copy */
+	if( stat( dest, &dest_st ) == 0 && dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino ) {
+		fprintf( stderr, "Can not copy \"%s\" over itself\n", src );
+		close( src_fd );
+		return( E_COPY_FILE );
+	}
+
+	/* Copy to a temporary file, a failed copy leaves dest untouched */
+	sprintf( tmp_filename, "%s.XXXXXX", dest );
+	if( ( dest_fd = mkstemp( tmp_filename ) ) == -1 ) {
+		perror( "Can not create copy!" );
+		close( src_fd );
+		return( E_OPEN_FILE );
+	}
+	fchmod( dest_fd, st.st_mode & 0777 );
+
+	/* Share data blocks with the source file if the file system can */
+	if( ioctl( dest_fd, FICLONE, src_fd ) == 0 ) {
+		close( src_fd );
+		return( install_copy( dest_fd, tmp_filename, dest ) );
+	}
+
+	/* Else let the kernel copy the data, ... */
+	while( ( count = copy_file_range( src_fd, NULL, dest_fd, NULL, 1 << 30, 0 ) ) > 0 )
+		;
+
+	/* ... or copy it ourselves if it can not */
+	if( count == -1 ) {
+		if( errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP ) {
+			perror( "Can not copy file!" );
+			close( src_fd );
+			close( dest_fd );
+			unlink( tmp_filename );
+			return( E_COPY_FILE );
+		}
+		while( ( count = read( src_fd, buffer, sizeof( buffer ) ) ) > 0 ) {
+			if( write( dest_fd, buffer, count ) != count ) {
+				count = -1;
+				break;
+			}
+		}
+		if( count == -1 ) {
+			perror( "Can not copy file!" );
+			close( src_fd );
+			close( dest_fd );
+			unlink( tmp_filename );
+			return( E_COPY_FILE );
+		}
+	}
+
+	close( src_fd );
+
+	return( install_copy( dest_fd, tmp_filename, dest ) );
+}
+
+int install_copy ( int fd, char *tmp_filename, char *dest )
+{
+	/* Replace dest in one step */
+	if( close( fd ) != 0 || rename( tmp_filename, dest ) != 0 ) {
+		perror( "Can not copy file!" );
+		unlink( tmp_filename );
+		return( E_COPY_FILE );
+	}
+
+	return( 0 );
+}
+
+int make_dirs ( char *path )
+{
+	char tmp_path[strlen( path ) + 1];
+	char *c;
+
+	strcpy( tmp_path, path );
+
+	/* Create every missing directory of the path */
+	for( c=tmp_path+1; ; c++ ) {
+		if( *c == '/' || *c == '\0' ) {
+			char end = *c;
+
+			*c = '\0';
+			if( mkdir( tmp_path, 0777 ) != 0 && errno != EEXIST ) {
+				perror( "Can not create directory!" );
+				return( E_CREATE_DIR );
+			}
+			*c = end;
+
+			if( end == '\0' )
+				break;
+		}
+	}
+
+	return( 0 );
+}
+
 int unpack_rsn_file ( char* filename, char *dest )
 {
 	int status;
@@ -797,6 +1834,36 @@ int pack_rsn_file ( char* filename, char *dest )
 	return( 0 );
 }
 
+int repack_rsn_file ( char* filename, char *dest, int backup )
+{
+	char tmp_filename[strlen( filename ) + 9];
+	int ret;
+
+	/* Pack next to the RSN file, then replace it in one step. It stays
+	   locked until then, and other processes never find it missing. */
+	strcpy( tmp_filename, filename );
+	strcat( tmp_filename, ".tmp.rsn" );
+	unlink( tmp_filename );
+	if( ( ret = pack_rsn_file( tmp_filename, dest ) ) != 0 ) {
+		unlink( tmp_filename );
+		return( ret );
+	}
+
+	if( backup && ( ret = backup_rsn_file( filename ) ) != 0 ) {
+		fprintf( stderr, "Can not backup %s!\n", filename );
+		unlink( tmp_filename );
+		return( ret );
+	}
+
+	if( rename( tmp_filename, filename ) != 0 ) {
+		perror( "Can not replace RSN file!" );
+		unlink( tmp_filename );
+		return( E_RENAME_FILE );
+	}
+
+	return( 0 );
+}
+
 int del_tmp_dir ( char* dirname )
 {
 	char *cur_dirname = getcwd( NULL, 0 );
@@ -0,0 +1,911 @@
+/*
+    index.c : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+    An index file can be used through mmap() without being parsed. All
+    numbers are 32 bits unsigned integers in host byte order :
+      - header     : magic, number of documents, trigrams, postings and
+                     size of strings
+      - documents  : offsets of file name, RSN member name and text in strings
+      - trigrams   : trigram, first posting and number of postings,
+                     sorted by trigram
+      - postings   : document numbers, sorted for each trigram
+      - strings    : '\0' terminated strings
+    A trigram is made of 3 consecutive bytes of the lower case text.
+
+    Updates are not written to the index itself but appended to INDEX.log,
+    so saving costs as much as the changes of the run. The log is a list
+    of batches, one per save :
+      - size of records (32 bits)
+      - records : '+' or '-', file name, RSN member name and text, each
+        '\0' terminated. '-' removes a document and has an empty text.
+      - size of records again, then LOG_MAGIC
+    A batch cut by a crash is ignored, and dropped by the next save.
+    Searches read the index, then the log, whose records replace documents
+    of the index. When the log grows bigger than the index, both are
+    merged into a new index (compaction).
+
+    INDEX.lock is locked while the log is written or compacted, and while
+    a search reads the index and the log.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "constants.h"
+#include "charset.h"
+#include "index.h"
+#include "util.h"
+
+
+#define INDEX_MAGIC "espidx1"
+#define LOG_MAGIC   "eidx"
+
+/* Smallest log which is compacted */
+#define LOG_MIN_COMPACT ( 1 << 20 )
+
+/* Part of the query trigrams a document must hold to match a fuzzy search */
+#define FUZZY_RATIO 0.6
+
+
+typedef struct
+{
+	char magic[8];
+	uint32_t doc_count;
+	uint32_t trigram_count;
+	uint32_t posting_count;
+	uint32_t strings_size;
+} index_header;
+
+typedef struct
+{
+	uint32_t path;
+	uint32_t member;
+	uint32_t text;
+} index_doc_entry;
+
+typedef struct
+{
+	uint32_t trigram;
+	uint32_t first;
+	uint32_t count;
+} index_trigram_entry;
+
+/* A mapped index file */
+typedef struct
+{
+	void *data;
+	size_t size;
+	index_header *header;
+	index_doc_entry *docs;
+	index_trigram_entry *trigrams;
+	uint32_t *postings;
+	char *strings;
+} index_map;
+
+/* A document of the index being updated, or a change to apply to it */
+typedef struct
+{
+	char *path;		/* Absolute file name                    */
+	char *member;		/* SPC file name in a RSN file, or ""    */
+	char *text;		/* Tags text                             */
+	int removed;		/* Non null if the file no longer exists */
+} index_doc;
+
+
+static char index_filename[PATH_MAX];	/* Index being updated, empty if none */
+static int modified = 0;		/* Non null if it changed             */
+static index_doc *docs = NULL;
+static size_t doc_count = 0;
+static size_t doc_allocated = 0;
+static size_t *slots = NULL;		/* Hash table of document numbers + 1 */
+static size_t slot_count = 0;
+
+
+static uint64_t hash_key( const char *path, const char *member )
+{
+	return fnv1a( fnv1a_string( FNV1A_INIT, path ), member, strlen( member ) );
+}
+
+static size_t *find_slot( const char *path, const char *member )
+{
+	size_t i = hash_key( path, member ) & ( slot_count - 1 );
+
+	while( slots[i] ) {
+		index_doc *doc = &docs[slots[i] - 1];
+
+		if( strcmp( doc->path, path ) == 0 && strcmp( doc->member, member ) == 0 )
+			break;
+		i = ( i + 1 ) & ( slot_count - 1 );
+	}
+
+	return &slots[i];
+}
+
+static void grow_slots()
+{
+	size_t i;
+
+	free( slots );
+	slot_count = slot_count ? slot_count * 2 : 1024;
+	slots = calloc( slot_count, sizeof( size_t ) );
+
+	for( i=0; i<doc_count; i++ )
+		*find_slot( docs[i].path, docs[i].member ) = i + 1;
+}
+
+static index_doc *add_doc( const char *path, const char *member )
+{
+	size_t *slot;
+
+	if( ( doc_count + 1 ) * 2 > slot_count )
+		grow_slots();
+
+	slot = find_slot( path, member );
+	if( *slot )
+		return &docs[*slot - 1];
+
+	if( doc_count == doc_allocated ) {
+		doc_allocated = doc_allocated ? doc_allocated * 2 : 1024;
+		docs = realloc( docs, doc_allocated * sizeof( index_doc ) );
+	}
+	docs[doc_count].path = strdup( path );
+	docs[doc_count].member = strdup( member );
+	docs[doc_count].text = NULL;
+	docs[doc_count].removed = 1;
+	*slot = ++doc_count;
+
+	return &docs[doc_count - 1];
+}
+
+static void free_docs( index_doc *list, size_t count )
+{
+	size_t i;
+
+	for( i=0; i<count; i++ ) {
+		free( list[i].path );
+		free( list[i].member );
+		free( list[i].text );
+	}
+	free( list );
+}
+
+/* Check every offset of a mapped index once, so searches never read
+   outside of the mapping */
+static int valid_index( index_map *map )
+{
+	index_header *header = map->header;
+	uint64_t size;
+	uint32_t i;
+
+	/* Counts are 32 bits, this sum can not overflow */
+	size = sizeof( index_header )
+	     + (uint64_t)header->doc_count * sizeof( index_doc_entry )
+	     + (uint64_t)header->trigram_count * sizeof( index_trigram_entry )
+	     + (uint64_t)header->posting_count * sizeof( uint32_t )
+	     + header->strings_size;
+	if( size != map->size )
+		return 0;
+
+	map->docs = (index_doc_entry *)( header + 1 );
+	map->trigrams = (index_trigram_entry *)( map->docs + header->doc_count );
+	map->postings = (uint32_t *)( map->trigrams + header->trigram_count );
+	map->strings = (char *)( map->postings + header->posting_count );
+
+	/* Strings are '\0' terminated, an offset below strings_size is enough */
+	if( header->strings_size > 0 && map->strings[header->strings_size - 1] != '\0' )
+		return 0;
+	for( i=0; i<header->doc_count; i++ ) {
+		if( map->docs[i].path >= header->strings_size
+		 || map->docs[i].member >= header->strings_size
+		 || map->docs[i].text >= header->strings_size )
+			return 0;
+	}
+	for( i=0; i<header->trigram_count; i++ ) {
+		if( (uint64_t)map->trigrams[i].first + map->trigrams[i].count > header->posting_count )
+			return 0;
+	}
+	for( i=0; i<header->posting_count; i++ ) {
+		if( map->postings[i] >= header->doc_count )
+			return 0;
+	}
+
+	return 1;
+}
+
+static int map_index( char *filename, index_map *map )
+{
+	struct stat st;
+	int fd;
+
+	if( ( fd = open( filename, O_RDONLY ) ) == -1 )
+		return( E_OPEN_FILE );
+	if( fstat( fd, &st ) != 0 || ( st.st_size > 0 && st.st_size < sizeof( index_header ) ) ) {
+		close( fd );
+		fprintf( stderr, "%s is not an espctag index!\n", filename );
+		return( E_INDEX );
+	}
+
+	/* An index created by index_open() and never saved */
+	if( st.st_size == 0 ) {
+		static index_header empty;
+
+		close( fd );
+		memset( map, 0, sizeof( index_map ) );
+		map->header = &empty;
+		return( 0 );
+	}
+
+	map->size = st.st_size;
+	map->data = mmap( NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( map->data == MAP_FAILED ) {
+		perror( "Can not map index!" );
+		return( E_INDEX );
+	}
+
+	map->header = map->data;
+	if( memcmp( map->header->magic, INDEX_MAGIC, sizeof( INDEX_MAGIC ) ) != 0 || ! valid_index( map ) ) {
+		fprintf( stderr, "%s is not an espctag index!\n", filename );
+		munmap( map->data, map->size );
+		return( E_INDEX );
+	}
+
+	return( 0 );
+}
+
+static void unmap_index( index_map *map )
+{
+	if( map->data )
+		munmap( map->data, map->size );
+}
+
+/* Wait until no other process saves the index. Return a descriptor to close. */
+static int lock_index( short type )
+{
+	char lock_filename[strlen( index_filename ) + 6];
+	int fd;
+
+	sprintf( lock_filename, "%s.lock", index_filename );
+	if( ( fd = open( lock_filename, O_RDWR | O_CREAT, 0666 ) ) == -1 || lock_fd( fd, type ) != 0 ) {
+		perror( "Can not lock index!" );
+		if( fd != -1 )
+			close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Load the index on disk in the documents table, which must be empty */
+static int load_index()
+{
+	index_map map;
+	uint32_t i;
+	int ret;
+
+	if( ( ret = map_index( index_filename, &map ) ) != 0 ) {
+		if( ret == E_OPEN_FILE )
+			perror( "Unable to open index!" );
+		return( ret );
+	}
+
+	for( i=0; i<map.header->doc_count; i++ ) {
+		index_doc *doc = add_doc( map.strings + map.docs[i].path, map.strings + map.docs[i].member );
+
+		doc->text = strdup( map.strings + map.docs[i].text );
+		doc->removed = 0;
+	}
+
+	unmap_index( &map );
+
+	return( 0 );
+}
+
+int index_open( char *filename )
+{
+	index_map map;
+	int fd;
+	int ret;
+
+	/* Create the index now, so its name can be resolved. It is saved at
+	   exit, the current directory may have changed. */
+	if( ( fd = open( filename, O_RDONLY | O_CREAT, 0666 ) ) == -1 || close( fd ) != 0
+	 || realpath( filename, index_filename ) == NULL ) {
+		perror( "Unable to open index!" );
+		index_filename[0] = '\0';
+		return( E_INDEX );
+	}
+
+	/* Only check the index, changes are appended to the log */
+	if( ( fd = lock_index( F_RDLCK ) ) == -1 ) {
+		index_filename[0] = '\0';
+		return( E_INDEX );
+	}
+	ret = map_index( index_filename, &map );
+	close( fd );
+	if( ret != 0 ) {
+		index_filename[0] = '\0';
+		return( ret );
+	}
+	unmap_index( &map );
+
+	return( 0 );
+}
+
+void index_update( char *path, char *member, char *text )
+{
+	index_doc *doc;
+
+	if( index_filename[0] == '\0' )
+		return;
+
+	doc = add_doc( path, member );
+	free( doc->text );
+	doc->text = strdup( text );
+	doc->removed = 0;
+	modified = 1;
+}
+
+void index_remove( char *path, char *member )
+{
+	index_doc *doc;
+
+	if( index_filename[0] == '\0' )
+		return;
+
+	doc = add_doc( path, member );
+	free( doc->text );
+	doc->text = NULL;
+	doc->removed = 1;
+	modified = 1;
+}
+
+static int compare_uint64( const void *a, const void *b )
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return( x < y ? -1 : x > y );
+}
+
+static uint32_t trigram_at( const char *text )
+{
+	return( ( (unsigned char)text[0] << 16 ) | ( (unsigned char)text[1] << 8 ) | (unsigned char)text[2] );
+}
+
+/* Add offset of string to strings buffer */
+static uint32_t add_string( char **strings, size_t *size, size_t *allocated, const char *string )
+{
+	size_t offset = *size;
+	size_t length = strlen( string ) + 1;
+
+	while( *size + length > *allocated ) {
+		*allocated = *allocated ? *allocated * 2 : 65536;
+		*strings = realloc( *strings, *allocated );
+	}
+	memcpy( *strings + *size, string, length );
+	*size += length;
+
+	return offset;
+}
+
+/* Write the documents table as the new index */
+static int write_index()
+{
+	index_header header;
+	index_doc_entry *entries;
+	uint64_t *pairs = NULL;
+	size_t pair_count = 0, pair_allocated = 0;
+	index_trigram_entry *trigrams;
+	uint32_t *postings;
+	char *strings = NULL;
+	size_t strings_size = 0, strings_allocated = 0;
+	size_t i, live = 0, trigram_count = 0;
+	FILE *file;
+	int ret;
+
+	entries = malloc( ( doc_count + 1 ) * sizeof( index_doc_entry ) );
+
+	/* Give new numbers to documents and collect their trigrams */
+	for( i=0; i<doc_count; i++ ) {
+		char text[CHARSET_BUFFER_SIZE];
+		size_t length, j;
+
+		if( docs[i].removed )
+			continue;
+
+		entries[live].path = add_string( &strings, &strings_size, &strings_allocated, docs[i].path );
+		entries[live].member = add_string( &strings, &strings_size, &strings_allocated, docs[i].member );
+		entries[live].text = add_string( &strings, &strings_size, &strings_allocated, docs[i].text );
+
+		strncpy( text, docs[i].text, CHARSET_BUFFER_SIZE - 1 );
+		text[CHARSET_BUFFER_SIZE - 1] = '\0';
+		charset_tolower( text );
+		length = strlen( text );
+
+		for( j=0; j+3<=length; j++ ) {
+			if( pair_count == pair_allocated ) {
+				pair_allocated = pair_allocated ? pair_allocated * 2 : 65536;
+				pairs = realloc( pairs, pair_allocated * sizeof( uint64_t ) );
+			}
+			pairs[pair_count++] = ( (uint64_t)trigram_at( text + j ) << 32 ) | live;
+		}
+
+		live++;
+	}
+
+	/* Sort by trigram then document, and remove duplicates */
+	qsort( pairs, pair_count, sizeof( uint64_t ), compare_uint64 );
+	postings = malloc( ( pair_count + 1 ) * sizeof( uint32_t ) );
+	trigrams = malloc( ( pair_count + 1 ) * sizeof( index_trigram_entry ) );
+	for( i=0, header.posting_count=0; i<pair_count; i++ ) {
+		uint32_t trigram = pairs[i] >> 32;
+
+		if( i > 0 && pairs[i] == pairs[i-1] )
+			continue;
+		if( trigram_count == 0 || trigrams[trigram_count-1].trigram != trigram ) {
+			trigrams[trigram_count].trigram = trigram;
+			trigrams[trigram_count].first = header.posting_count;
+			trigrams[trigram_count].count = 0;
+			trigram_count++;
+		}
+		trigrams[trigram_count-1].count++;
+		postings[header.posting_count++] = pairs[i] & 0xFFFFFFFF;
+	}
+	free( pairs );
+
+	memset( &header.magic, 0, sizeof( header.magic ) );
+	strcpy( header.magic, INDEX_MAGIC );
+	header.doc_count = live;
+	header.trigram_count = trigram_count;
+	header.strings_size = strings_size;
+
+	/* Write a new file, make it durable, then replace the old one */
+	char tmp_filename[strlen( index_filename ) + 5];
+	sprintf( tmp_filename, "%s.tmp", index_filename );
+	if( ( file = fopen( tmp_filename, "w" ) ) == NULL
+	 || fwrite( &header, sizeof( header ), 1, file ) != 1
+	 || fwrite( entries, sizeof( index_doc_entry ), live, file ) != live
+	 || fwrite( trigrams, sizeof( index_trigram_entry ), trigram_count, file ) != trigram_count
+	 || fwrite( postings, sizeof( uint32_t ), header.posting_count, file ) != header.posting_count
+	 || fwrite( strings, 1, strings_size, file ) != strings_size
+	 || fflush( file ) != 0
+	 || fsync( fileno( file ) ) != 0
+	 || fclose( file ) != 0
+	 || rename( tmp_filename, index_filename ) != 0 ) {
+		perror( "Can not write index!" );
+		unlink( tmp_filename );
+		ret = E_INDEX;
+	} else {
+		ret = 0;
+	}
+
+	free( entries );
+	free( trigrams );
+	free( postings );
+	free( strings );
+
+	return( ret );
+}
+
+static void clear_docs()
+{
+	free_docs( docs, doc_count );
+	docs = NULL;
+	doc_count = doc_allocated = 0;
+	free( slots );
+	slots = NULL;
+	slot_count = 0;
+}
+
+/* Read the log. Records are applied to the documents table if apply is
+   non null. Return the end of the last complete batch. */
+static off_t read_log( int fd, int apply )
+{
+	struct stat st;
+	char *data;
+	off_t offset = 0;
+
+	if( fstat( fd, &st ) != 0 || st.st_size == 0 )
+		return 0;
+	if( ( data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) ) == MAP_FAILED ) {
+		perror( "Can not map index log!" );
+		return 0;
+	}
+
+	while( st.st_size - offset >= 12 ) {
+		uint32_t size, end_size;
+		char *record, *end;
+
+		memcpy( &size, data + offset, 4 );
+		if( size > st.st_size - offset - 12 )
+			break;
+		memcpy( &end_size, data + offset + 4 + size, 4 );
+		if( end_size != size || memcmp( data + offset + 8 + size, LOG_MAGIC, 4 ) != 0 )
+			break;
+
+		record = data + offset + 4;
+		end = record + size;
+		while( apply && record < end ) {
+			char *type = record++;
+			char *path = record;
+			char *member, *text;
+			index_doc *doc;
+
+			/* Each string must end before the batch */
+			if( ( member = memchr( path, '\0', end - path ) ) == NULL )
+				break;
+			member++;
+			if( ( text = memchr( member, '\0', end - member ) ) == NULL )
+				break;
+			text++;
+			if( ( record = memchr( text, '\0', end - text ) ) == NULL )
+				break;
+			record++;
+
+			doc = add_doc( path, member );
+			free( doc->text );
+			doc->text = *type == '+' ? strdup( text ) : NULL;
+			doc->removed = *type != '+';
+		}
+
+		offset += size + 12;
+	}
+
+	munmap( data, st.st_size );
+
+	return offset;
+}
+
+/* Return the end of the last complete batch of the log. The whole log is
+   only read if it does not end with a complete batch. */
+static off_t log_end( int fd )
+{
+	struct stat st;
+	char tail[8];
+	uint32_t size, start_size;
+
+	if( fstat( fd, &st ) != 0 || st.st_size == 0 )
+		return 0;
+
+	if( st.st_size >= 12 && pread( fd, tail, 8, st.st_size - 8 ) == 8 && memcmp( tail + 4, LOG_MAGIC, 4 ) == 0 ) {
+		memcpy( &size, tail, 4 );
+		if( size <= st.st_size - 12 && pread( fd, &start_size, 4, st.st_size - 12 - size ) == 4 && start_size == size )
+			return st.st_size;
+	}
+
+	return read_log( fd, 0 );
+}
+
+/* Append the documents table to the log as one batch */
+static int append_log( int fd )
+{
+	char *batch = NULL;
+	size_t size = 4, allocated = 0;
+	uint32_t records_size;
+	off_t end;
+	size_t i;
+
+	/* Drop a batch cut by a crash */
+	end = log_end( fd );
+	if( ftruncate( fd, end ) != 0 ) {
+		perror( "Can not write index log!" );
+		return( E_INDEX );
+	}
+
+	for( i=0; i<doc_count; i++ ) {
+		add_string( &batch, &size, &allocated, docs[i].removed ? "-" : "+" );
+		size--;
+		add_string( &batch, &size, &allocated, docs[i].path );
+		add_string( &batch, &size, &allocated, docs[i].member );
+		add_string( &batch, &size, &allocated, docs[i].removed ? "" : docs[i].text );
+	}
+	batch = realloc( batch, size + 8 );
+
+	/* Sizes around records, then the magic */
+	records_size = size - 4;
+	memcpy( batch, &records_size, 4 );
+	memcpy( batch + size, &records_size, 4 );
+	memcpy( batch + size + 4, LOG_MAGIC, 4 );
+	size += 8;
+
+	if( pwrite( fd, batch, size, end ) != size || fsync( fd ) != 0 ) {
+		perror( "Can not write index log!" );
+		free( batch );
+		return( E_INDEX );
+	}
+	free( batch );
+
+	return( 0 );
+}
+
+/* Merge the index and its log into a new index, then empty the log */
+static int compact( int fd )
+{
+	int ret;
+
+	clear_docs();
+	if( ( ret = load_index() ) != 0 )
+		return( ret );
+	read_log( fd, 1 );
+	if( ( ret = write_index() ) != 0 )
+		return( ret );
+
+	/* If this fails, the log is read again over the new index, which
+	   gives the same documents */
+	if( ftruncate( fd, 0 ) != 0 || fsync( fd ) != 0 ) {
+		perror( "Can not write index log!" );
+		return( E_INDEX );
+	}
+
+	return( 0 );
+}
+
+static int open_log()
+{
+	char log_filename[strlen( index_filename ) + 5];
+	int fd;
+
+	sprintf( log_filename, "%s.log", index_filename );
+	if( ( fd = open( log_filename, O_RDWR | O_CREAT, 0666 ) ) == -1 )
+		perror( "Unable to open index log!" );
+
+	return fd;
+}
+
+int index_save()
+{
+	struct stat index_st, log_st;
+	int lock, fd;
+	int ret;
+
+	if( index_filename[0] == '\0' || ! modified )
+		return( 0 );
+
+	if( ( lock = lock_index( F_WRLCK ) ) == -1 )
+		return( E_INDEX );
+	if( ( fd = open_log() ) == -1 ) {
+		close( lock );
+		return( E_INDEX );
+	}
+
+	if( ( ret = append_log( fd ) ) == 0 ) {
+		modified = 0;
+
+		/* Compact when it costs no more than what was appended since the
+		   last compaction */
+		if( fstat( fd, &log_st ) == 0 && stat( index_filename, &index_st ) == 0
+		 && log_st.st_size > LOG_MIN_COMPACT && log_st.st_size > index_st.st_size )
+			ret = compact( fd );
+	}
+
+	close( fd );
+	close( lock );
+
+	return( ret );
+}
+
+int index_compact()
+{
+	int lock, fd;
+	int ret;
+
+	if( ( lock = lock_index( F_WRLCK ) ) == -1 )
+		return( E_INDEX );
+	if( ( fd = open_log() ) == -1 ) {
+		close( lock );
+		return( E_INDEX );
+	}
+
+	ret = compact( fd );
+
+	close( fd );
+	close( lock );
+
+	return( ret );
+}
+
+static index_trigram_entry *find_trigram( index_map *map, uint32_t trigram )
+{
+	size_t low = 0, high = map->header->trigram_count;
+
+	while( low < high ) {
+		size_t middle = ( low + high ) / 2;
+
+		if( map->trigrams[middle].trigram < trigram )
+			low = middle + 1;
+		else if( map->trigrams[middle].trigram > trigram )
+			high = middle;
+		else
+			return &map->trigrams[middle];
+	}
+
+	return NULL;
+}
+
+static void print_name( const char *path, const char *member )
+{
+	if( member[0] )
+		printf( "%s (%s)\n", path, member );
+	else
+		printf( "%s\n", path );
+}
+
+/* Print a document of the index, unless the log replaced it */
+static void print_doc( index_map *map, uint32_t doc )
+{
+	char *path = map->strings + map->docs[doc].path;
+	char *member = map->strings + map->docs[doc].member;
+
+	if( slot_count > 0 && *find_slot( path, member ) )
+		return;
+
+	print_name( path, member );
+}
+
+/* Return non null if text of a log record matches lower case query */
+static int text_matches( const char *text, const char *query, int fuzzy )
+{
+	char lower_text[CHARSET_BUFFER_SIZE];
+	size_t length = strlen( query );
+	size_t trigram_count = 0, found = 0;
+	size_t i, j;
+
+	strncpy( lower_text, text, CHARSET_BUFFER_SIZE - 1 );
+	lower_text[CHARSET_BUFFER_SIZE - 1] = '\0';
+	charset_tolower( lower_text );
+
+	if( length < 3 || ! fuzzy )
+		return( strstr( lower_text, query ) != NULL );
+
+	for( i=0; i+3<=length; i++ ) {
+		for( j=0; j<i; j++ ) {
+			if( trigram_at( query + j ) == trigram_at( query + i ) )
+				break;
+		}
+		if( j < i )
+			continue;
+		trigram_count++;
+		if( memmem( lower_text, strlen( lower_text ), query + i, 3 ) )
+			found++;
+	}
+
+	return( found >= trigram_count * FUZZY_RATIO );
+}
+
+/* Return non null if lower case query is in text */
+static int doc_contains( index_map *map, uint32_t doc, const char *query )
+{
+	char text[CHARSET_BUFFER_SIZE];
+
+	strncpy( text, map->strings + map->docs[doc].text, CHARSET_BUFFER_SIZE - 1 );
+	text[CHARSET_BUFFER_SIZE - 1] = '\0';
+	charset_tolower( text );
+
+	return( strstr( text, query ) != NULL );
+}
+
+/* Print documents of the log which match lower case query */
+static void print_log( const char *query, int fuzzy )
+{
+	size_t i;
+
+	for( i=0; i<doc_count; i++ ) {
+		if( ! docs[i].removed && text_matches( docs[i].text, query, fuzzy ) )
+			print_name( docs[i].path, docs[i].member );
+	}
+	clear_docs();
+}
+
+int index_search( char *filename, char *query, int fuzzy )
+{
+	char lower_query[strlen( query ) + 1];
+	size_t length = strlen( query );
+	index_map map;
+	uint32_t *counts;
+	size_t trigram_count = 0;
+	uint32_t doc;
+	size_t i;
+	int lock, fd;
+	int ret;
+
+	/* Read the index and its log while no process compacts them */
+	snprintf( index_filename, sizeof( index_filename ), "%s", filename );
+	if( ( lock = lock_index( F_RDLCK ) ) == -1 )
+		return( E_INDEX );
+	if( ( ret = map_index( filename, &map ) ) != 0 ) {
+		if( ret == E_OPEN_FILE )
+			perror( "Unable to open index!" );
+		close( lock );
+		return( ret );
+	}
+	char log_filename[strlen( filename ) + 5];
+	sprintf( log_filename, "%s.log", filename );
+	if( ( fd = open( log_filename, O_RDONLY ) ) != -1 ) {
+		read_log( fd, 1 );
+		close( fd );
+	}
+	close( lock );
+
+	strcpy( lower_query, query );
+	charset_tolower( lower_query );
+
+	/* Too short for trigrams, check every document */
+	if( length < 3 ) {
+		for( doc=0; doc<map.header->doc_count; doc++ ) {
+			if( doc_contains( &map, doc, lower_query ) )
+				print_doc( &map, doc );
+		}
+		print_log( lower_query, fuzzy );
+		unmap_index( &map );
+		return( 0 );
+	}
+
+	/* Count query trigrams found in each document */
+	counts = calloc( map.header->doc_count + 1, sizeof( uint32_t ) );
+	for( i=0; i+3<=length; i++ ) {
+		index_trigram_entry *trigram;
+		size_t j;
+
+		/* Count each trigram of the query only once */
+		for( j=0; j<i; j++ ) {
+			if( trigram_at( lower_query + j ) == trigram_at( lower_query + i ) )
+				break;
+		}
+		if( j < i )
+			continue;
+		trigram_count++;
+
+		if( ( trigram = find_trigram( &map, trigram_at( lower_query + i ) ) ) == NULL )
+			continue;
+		for( j=0; j<trigram->count; j++ )
+			counts[map.postings[trigram->first + j]]++;
+	}
+
+	for( doc=0; doc<map.header->doc_count; doc++ ) {
+		if( fuzzy ) {
+			/* Enough trigrams, the text looks like the query */
+			if( counts[doc] >= trigram_count * FUZZY_RATIO )
+				print_doc( &map, doc );
+		} else {
+			/* All trigrams, check the text really holds the query */
+			if( counts[doc] == trigram_count && doc_contains( &map, doc, lower_query ) )
+				print_doc( &map, doc );
+		}
+	}
+
+	free( counts );
+	print_log( lower_query, fuzzy );
+	unmap_index( &map );
+
+	return( 0 );
+}
@@ -0,0 +1,214 @@
+/*
+    journal.c : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+    A journal is an append-only file. It starts with JOURNAL_MAGIC, then
+    holds one record per modified SPC file :
+      - length of archive, old name and new name (2 bytes each, little endian)
+      - archive, old name and new name (without trailing '\0')
+      - the JOURNAL_HEADER_SIZE first bytes of the original SPC file
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "journal.h"
+
+
+#define JOURNAL_MAGIC "espctag-journal-1\n"
+
+
+static FILE *journal = NULL;	/* The opened journal */
+
+
+static int write_length( size_t length )
+{
+	unsigned char bytes[2] = { length & 0xFF, ( length >> 8 ) & 0xFF };
+
+	return( fwrite( bytes, 2, 1, journal ) == 1 ? 0 : -1 );
+}
+
+static int read_length( FILE *file, size_t *length )
+{
+	unsigned char bytes[2];
+
+	if( fread( bytes, 2, 1, file ) != 1 )
+		return -1;
+	*length = bytes[0] | ( bytes[1] << 8 );
+
+	return 0;
+}
+
+static char *read_string( FILE *file, size_t length )
+{
+	char *string = malloc( length + 1 );
+
+	if( string == NULL )
+		return NULL;
+	if( length > 0 && fread( string, length, 1, file ) != 1 ) {
+		free( string );
+		return NULL;
+	}
+	string[length] = '\0';
+
+	return string;
+}
+
+int journal_open( char *filename )
+{
+	if( ( journal = fopen( filename, "a" ) ) == NULL ) {
+		perror( "Unable to open journal!" );
+		return( E_JOURNAL );
+	}
+
+	/* Write magic string in new journals */
+	fseek( journal, 0, SEEK_END );
+	if( ftell( journal ) == 0 && fputs( JOURNAL_MAGIC, journal ) == EOF ) {
+		perror( "Can not write journal!" );
+		return( E_JOURNAL );
+	}
+
+	return( 0 );
+}
+
+int journal_read_header( FILE *spc_file, unsigned char *header )
+{
+	memset( header, 0, JOURNAL_HEADER_SIZE );
+
+	fseek( spc_file, 0, SEEK_SET );
+	fread( header, JOURNAL_HEADER_SIZE, 1, spc_file );
+	if( ferror( spc_file ) ) {
+		perror( "Can not read SPC header!" );
+		return( E_JOURNAL );
+	}
+	fseek( spc_file, 0, SEEK_SET );
+
+	return( 0 );
+}
+
+int journal_add( char *archive, char *old_name, char *new_name, unsigned char *header )
+{
+	if( journal == NULL )
+		return( 0 );
+
+	if( write_length( strlen( archive ) ) != 0
+	 || write_length( strlen( old_name ) ) != 0
+	 || write_length( strlen( new_name ) ) != 0
+	 || fputs( archive, journal ) == EOF
+	 || fputs( old_name, journal ) == EOF
+	 || fputs( new_name, journal ) == EOF
+	 || fwrite( header, JOURNAL_HEADER_SIZE, 1, journal ) != 1
+	 || fflush( journal ) != 0 ) {
+		perror( "Can not write journal!" );
+		return( E_JOURNAL );
+	}
+
+	return( 0 );
+}
+
+int journal_commit()
+{
+	if( journal == NULL )
+		return( 0 );
+
+	/* Data is only synced once, at the end of the run */
+	if( fflush( journal ) != 0 || fsync( fileno( journal ) ) != 0 ) {
+		perror( "Can not sync journal!" );
+		fclose( journal );
+		journal = NULL;
+		return( E_JOURNAL );
+	}
+	fclose( journal );
+	journal = NULL;
+
+	return( 0 );
+}
+
+journal_entry *journal_load( char *filename, size_t *count )
+{
+	FILE *file;
+	char magic[sizeof( JOURNAL_MAGIC )];
+	journal_entry *entries = NULL;
+	size_t allocated = 0;
+	size_t archive_length, old_length, new_length;
+
+	*count = 0;
+
+	if( ( file = fopen( filename, "r" ) ) == NULL ) {
+		perror( "Unable to open journal!" );
+		return NULL;
+	}
+	allocated = 64;
+	entries = malloc( allocated * sizeof( journal_entry ) );
+
+	if( fgets( magic, sizeof( magic ), file ) == NULL || strcmp( magic, JOURNAL_MAGIC ) != 0 ) {
+		fprintf( stderr, "%s is not an espctag journal!\n", filename );
+		fclose( file );
+		free( entries );
+		return NULL;
+	}
+
+	while( read_length( file, &archive_length ) == 0 ) {
+		journal_entry *entry;
+
+		if( *count == allocated ) {
+			allocated *= 2;
+			entries = realloc( entries, allocated * sizeof( journal_entry ) );
+		}
+		entry = &entries[*count];
+		entry->archive = entry->old_name = entry->new_name = NULL;
+
+		if( read_length( file, &old_length ) != 0
+		 || read_length( file, &new_length ) != 0
+		 || ( entry->archive = read_string( file, archive_length ) ) == NULL
+		 || ( entry->old_name = read_string( file, old_length ) ) == NULL
+		 || ( entry->new_name = read_string( file, new_length ) ) == NULL
+		 || fread( entry->header, JOURNAL_HEADER_SIZE, 1, file ) != 1 ) {
+			/* Ignore a truncated last record */
+			fprintf( stderr, "%s: truncated record ignored\n", filename );
+			free( entry->archive );
+			free( entry->old_name );
+			free( entry->new_name );
+			break;
+		}
+
+		(*count)++;
+	}
+
+	fclose( file );
+
+	return entries;
+}
+
+void journal_free( journal_entry *entries, size_t count )
+{
+	size_t i;
+
+	for( i=0; i<count; i++ ) {
+		free( entries[i].archive );
+		free( entries[i].old_name );
+		free( entries[i].new_name );
+	}
+	free( entries );
+}
@@ -0,0 +1,40 @@
+/*
+    journal.h : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+
+/* Size of the SPC header saved for each modified file (holds ID666 tags) */
+#define JOURNAL_HEADER_SIZE 256
+
+/* This structure holds what is necessary to restore one SPC file */
+typedef struct
+{
+	char *archive;		/* RSN file holding the SPC file, empty for a plain SPC file */
+	char *old_name;		/* File name before modification                            */
+	char *new_name;		/* File name after modification                             */
+	unsigned char header[JOURNAL_HEADER_SIZE];	/* Original header              */
+} journal_entry;
+
+int journal_open( char *filename );
+int journal_read_header( FILE *spc_file, unsigned char *header );
+int journal_add( char *archive, char *old_name, char *new_name, unsigned char *header );
+int journal_commit();
+journal_entry *journal_load( char *filename, size_t *count );
+void journal_free( journal_entry *entries, size_t count );
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+#   rename_test.sh : espctag
+#   v0.5 - 2026-10-19
+#
+#   This file is part of espctag.
+#
+#   espctag is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   espctag is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Usage: rename_test.sh ESPCTAG
+# Rename several files, and one file several times, in a single run.
+
+ESPCTAG=$1
+DIR=`mktemp -d /tmp/espctag-test-XXXXXX` || exit 1
+trap 'rm -rf "$DIR"' EXIT
+FAILED=0
+
+# Write an empty SPC file with ID666 tags and a song title
+make_spc()
+{
+	head -c 66048 /dev/zero > "$DIR/$1"
+	printf 'SNES-SPC700 Sound File Data v0.30\032\032\032\036' | dd of="$DIR/$1" conv=notrunc 2> /dev/null
+	printf '%s' "$2" | dd of="$DIR/$1" bs=1 seek=46 conv=notrunc 2> /dev/null
+}
+
+check()
+{
+	if [ ! -f "$DIR/$1" ]; then
+		echo "$1 is missing, found:" `ls "$DIR"`
+		FAILED=1
+	fi
+}
+
+make_spc a.spc Alpha
+make_spc b.spc Beta
+"$ESPCTAG" -r '%s.spc' "$DIR/a.spc" "$DIR/b.spc" > /dev/null
+check Alpha.spc
+check Beta.spc
+
+make_spc c.spc Title
+"$ESPCTAG" --op=set --op=rename --op=set --op=rename -r '%s.spc' -ST2 "$DIR/c.spc" > /dev/null
+check T2.spc
+
+exit $FAILED
@@ -0,0 +1,287 @@
+/*
+    sync.c : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+    SPC files are paired by a hash of their payload (RAM, DSP registers
+    and extra RAM), which tags and renaming do not change.
+
+    A delta file starts with DELTA_MAGIC, then holds one line per field :
+      HASH	FIELD	VALUE
+    where HASH is the payload hash in hexadecimal, FIELD a tag index or
+    SYNC_NAME, and VALUE the new value with backslash, tab and new line
+    escaped.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <ftw.h>
+
+#include "constants.h"
+#include "sync.h"
+#include "util.h"
+
+
+#define DELTA_MAGIC "espctag-delta-1\n"
+
+/* Payload of a SPC file */
+#define PAYLOAD_OFFSET 0x100
+#define PAYLOAD_SIZE   0x10100
+
+
+static char **walk_files = NULL;	/* Files found by sync_list_files() */
+static size_t walk_count = 0;
+static size_t walk_allocated = 0;
+
+static sync_entry *entries = NULL;	/* Hash table of reference files */
+static size_t entry_count = 0;
+static size_t slot_count = 0;
+
+static FILE *delta = NULL;		/* Delta file being written */
+
+
+static int add_walk_file( const char *path, const struct stat *st, int type, struct FTW *ftw )
+{
+	size_t length = strlen( path );
+
+	if( type != FTW_F || length < 4 || strcasecmp( path + length - 4, ".spc" ) != 0 )
+		return 0;
+
+	if( walk_count == walk_allocated ) {
+		walk_allocated = walk_allocated ? walk_allocated * 2 : 1024;
+		walk_files = realloc( walk_files, walk_allocated * sizeof( char * ) );
+	}
+	walk_files[walk_count++] = strdup( path );
+
+	return 0;
+}
+
+static int compare_strings( const void *a, const void *b )
+{
+	return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+char **sync_list_files( char *dirname, size_t *count )
+{
+	char **files;
+
+	walk_files = NULL;
+	walk_count = walk_allocated = 0;
+
+	if( nftw( dirname, add_walk_file, 32, FTW_PHYS ) != 0 ) {
+		perror( "Can not walk directory!" );
+		sync_free_files( walk_files, walk_count );
+		return NULL;
+	}
+
+	/* Always process files in the same order */
+	qsort( walk_files, walk_count, sizeof( char * ), compare_strings );
+
+	files = walk_files ? walk_files : malloc( sizeof( char * ) );
+	*count = walk_count;
+	walk_files = NULL;
+
+	return files;
+}
+
+void sync_free_files( char **files, size_t count )
+{
+	size_t i;
+
+	for( i=0; i<count; i++ )
+		free( files[i] );
+	free( files );
+}
+
+int sync_payload_hash( char *filename, uint64_t *hash )
+{
+	unsigned char buffer[4096];
+	size_t left = PAYLOAD_SIZE;
+	size_t count;
+	FILE *file;
+
+	if( ( file = fopen( filename, "r" ) ) == NULL || fseek( file, PAYLOAD_OFFSET, SEEK_SET ) != 0 ) {
+		perror( "Can not read SPC file!" );
+		if( file )
+			fclose( file );
+		return( E_OPEN_FILE );
+	}
+
+	*hash = FNV1A_INIT;
+	while( left > 0 && ( count = fread( buffer, 1, left < sizeof( buffer ) ? left : sizeof( buffer ), file ) ) > 0 ) {
+		*hash = fnv1a( *hash, buffer, count );
+		left -= count;
+	}
+
+	fclose( file );
+
+	return( 0 );
+}
+
+static sync_entry *find_slot( uint64_t hash )
+{
+	size_t i = hash & ( slot_count - 1 );
+
+	while( entries[i].used && entries[i].hash != hash )
+		i = ( i + 1 ) & ( slot_count - 1 );
+
+	return &entries[i];
+}
+
+sync_entry *sync_find( uint64_t hash, int create )
+{
+	sync_entry *entry;
+
+	if( slot_count == 0 && ! create )
+		return NULL;
+
+	if( create && ( entry_count + 1 ) * 2 > slot_count ) {
+		sync_entry *old_entries = entries;
+		size_t old_count = slot_count;
+		size_t i;
+
+		slot_count = slot_count ? slot_count * 2 : 1024;
+		entries = calloc( slot_count, sizeof( sync_entry ) );
+		for( i=0; i<old_count; i++ ) {
+			if( old_entries[i].used )
+				*find_slot( old_entries[i].hash ) = old_entries[i];
+		}
+		free( old_entries );
+	}
+
+	entry = find_slot( hash );
+	if( ! entry->used ) {
+		if( ! create )
+			return NULL;
+		entry->hash = hash;
+		entry->used = 1;
+		entry_count++;
+	}
+
+	return entry;
+}
+
+int sync_delta_open( char *filename )
+{
+	if( ( delta = fopen( filename, "w" ) ) == NULL || fputs( DELTA_MAGIC, delta ) == EOF ) {
+		perror( "Unable to open delta file!" );
+		return( E_SYNC );
+	}
+
+	return( 0 );
+}
+
+int sync_delta_add( sync_entry *entry, int field )
+{
+	char *c;
+
+	if( delta == NULL || ( entry->delta_fields & ( 1 << field ) ) )
+		return( 0 );
+	entry->delta_fields |= 1 << field;
+
+	fprintf( delta, "%016" PRIx64 "\t%d\t", entry->hash, field );
+	for( c=entry->values[field]; *c; c++ ) {
+		switch( *c ) {
+			case '\\': fputs( "\\\\", delta ); break;
+			case '\t': fputs( "\\t", delta );  break;
+			case '\n': fputs( "\\n", delta );  break;
+			default:   fputc( *c, delta );
+		}
+	}
+	if( fputc( '\n', delta ) == EOF ) {
+		perror( "Can not write delta file!" );
+		return( E_SYNC );
+	}
+
+	return( 0 );
+}
+
+int sync_delta_close()
+{
+	if( delta == NULL )
+		return( 0 );
+
+	if( fclose( delta ) != 0 ) {
+		perror( "Can not write delta file!" );
+		delta = NULL;
+		return( E_SYNC );
+	}
+	delta = NULL;
+
+	return( 0 );
+}
+
+int sync_delta_load( char *filename )
+{
+	FILE *file;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t length;
+
+	if( ( file = fopen( filename, "r" ) ) == NULL ) {
+		perror( "Unable to open delta file!" );
+		return( E_SYNC );
+	}
+
+	if( getline( &line, &size, file ) <= 0 || strcmp( line, DELTA_MAGIC ) != 0 ) {
+		fprintf( stderr, "%s is not an espctag delta file!\n", filename );
+		free( line );
+		fclose( file );
+		return( E_SYNC );
+	}
+
+	while( ( length = getline( &line, &size, file ) ) > 0 ) {
+		sync_entry *entry;
+		uint64_t hash;
+		int field;
+		int offset;
+		char *in, *out;
+
+		if( sscanf( line, "%" SCNx64 "\t%d\t%n", &hash, &field, &offset ) != 2 || field < 0 || field >= SYNC_FIELDS ) {
+			fprintf( stderr, "%s: invalid line ignored\n", filename );
+			continue;
+		}
+
+		/* Unescape value */
+		for( in=out=line+offset; *in && *in != '\n'; in++ ) {
+			if( *in == '\\' && in[1] ) {
+				in++;
+				*out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+			} else {
+				*out++ = *in;
+			}
+		}
+		*out = '\0';
+
+		entry = sync_find( hash, 1 );
+		free( entry->values[field] );
+		entry->values[field] = strdup( line + offset );
+	}
+
+	free( line );
+	fclose( file );
+
+	return( 0 );
+}
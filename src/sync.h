@@ -0,0 +1,43 @@
+/*
+    sync.h : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+/* Synced fields : tags (see tags index in constants.h) and file name */
+#define SYNC_NAME   10
+#define SYNC_FIELDS 11
+
+/* This structure holds the reference fields of a SPC file */
+typedef struct
+{
+	uint64_t hash;			/* Hash of the SPC file without its header      */
+	char *values[SYNC_FIELDS];	/* Reference values, NULL if unknown            */
+	unsigned int delta_fields;	/* Fields already written to the delta file     */
+	int used;			/* Non null if this entry of the table is used  */
+} sync_entry;
+
+char **sync_list_files( char *dirname, size_t *count );
+void sync_free_files( char **files, size_t count );
+int sync_payload_hash( char *filename, uint64_t *hash );
+sync_entry *sync_find( uint64_t hash, int create );
+int sync_delta_open( char *filename );
+int sync_delta_add( sync_entry *entry, int field );
+int sync_delta_close();
+int sync_delta_load( char *filename );
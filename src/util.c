@@ -0,0 +1,68 @@
+/*
+    util.c : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "util.h"
+
+
+/* Continue a 64 bits FNV-1a hash with length bytes of data. Shard numbers
+   and delta files depend on it, it must give the same result everywhere. */
+uint64_t fnv1a( uint64_t hash, const void *data, size_t length )
+{
+	const unsigned char *bytes = data;
+	size_t i;
+
+	for( i=0; i<length; i++ )
+		hash = ( hash ^ bytes[i] ) * 1099511628211ULL;
+
+	return hash;
+}
+
+/* Continue a hash with a string and its trailing '\0' */
+uint64_t fnv1a_string( uint64_t hash, const char *string )
+{
+	return fnv1a( hash, string, strlen( string ) + 1 );
+}
+
+/* Wait for a lock of type on the whole file fd */
+int lock_fd( int fd, short type )
+{
+	struct flock lock;
+
+	memset( &lock, 0, sizeof( lock ) );
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+
+	/* Open file description locks are not released when another
+	   descriptor of the file is closed. Use POSIX locks if the
+	   kernel does not know them. */
+	if( fcntl( fd, F_OFD_SETLKW, &lock ) == 0 )
+		return 0;
+	if( errno != EINVAL )
+		return -1;
+
+	return fcntl( fd, F_SETLKW, &lock );
+}
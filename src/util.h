@@ -0,0 +1,29 @@
+/*
+    util.h : espctag
+    v0.5 - 2026-10-19
+
+    This file is part of espctag.
+
+    espctag is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    espctag is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with espctag.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Initial value of a FNV-1a hash */
+#define FNV1A_INIT 14695981039346656037ULL
+
+uint64_t fnv1a( uint64_t hash, const void *data, size_t length );
+uint64_t fnv1a_string( uint64_t hash, const char *string );
+int lock_fd( int fd, short type );